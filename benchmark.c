@@ -0,0 +1,455 @@
+#define _GNU_SOURCE	// pipe2()
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <mqueue.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/limits.h>	// PIPE_BUF
+
+#include "ioctl_cmd.h" // IOCTL commands
+
+#define DEVICE_DIR "/dev/"
+#define CONTROL_DEVICE "/dev/mailslot-ctl"
+#define MQUEUE_MAX_PATH "/proc/sys/fs/mqueue/msg_max"
+#define STAMP_SIZE sizeof(__u64)	// Every message starts with its send time, 0 for the end of the run
+#define MAX_SLOTS 256
+#define MAX_WORKERS 256
+#define NODE_ATTEMPTS 1000	// Milliseconds given to udev to create the device node of a new mailslot
+#define VERSION "1.0"
+
+/* Transports under test: the same workload runs on each of them */
+enum transport { MAILSLOT, PIPE, MQUEUE, UNIX_SEQPACKET, TRANSPORTS };
+
+static const char* transport_names[TRANSPORTS] = { "mailslot", "pipe", "mq", "unix" };
+
+/* Workload */
+struct config {
+	int producers;
+	int consumers;
+	int slots;				// Independent channels: producer and consumer i use channel i % slots
+	long count;				// Messages sent by each producer
+	size_t size;			// Message size, at least STAMP_SIZE
+	size_t storage;			// Buffering of a channel in bytes (mailslot budget, pipe size, socket buffer, queue length)
+	int non_blocking;		// O_NONBLOCK, retrying on EAGAIN
+	int processes;			// Workers are processes instead of threads
+	const char* device;		// Existing mailslot device to use, instead of creating the slots through the control device
+	int transports;			// Bitmap of the transports to run
+};
+
+/* A channel: messages written to out are read from in (the same descriptor for mailslots and message queues) */
+struct channel {
+	int in;
+	int out;
+	int minor;				// Mailslot created through the control device, -1 otherwise
+};
+
+/* State shared by the workers, in a shared mapping so that it is seen by worker processes as well */
+struct shared {
+	volatile int go;		// Set once every worker is ready
+	long next_sample;		// Next free entry of samples
+	long capacity;
+	__u64 samples[];		// Send to receive time of each message, in ns
+};
+
+struct worker {
+	int id;
+	enum transport transport;
+	struct config* config;
+	struct channel* channel;
+	struct shared* shared;
+	pthread_t thread;
+	pid_t pid;
+};
+
+
+static __u64 now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);	// Shared by the processes as well
+
+	return (__u64) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+}
+
+
+/* One message, whatever the transport. In non-blocking mode EAGAIN is retried until the transfer succeeds. */
+static ssize_t send_message(enum transport transport, int fd, const char* buffer, size_t len, int non_blocking) {
+
+	ssize_t result;
+
+	do {
+		if (transport == MQUEUE) result = mq_send(fd, buffer, len, 0) == 0 ? (ssize_t) len : -1;
+		else result = write(fd, buffer, len);
+		if (result < 0 && non_blocking && errno == EAGAIN) sched_yield();	// Let the other side run on a busy CPU
+	} while (result < 0 && ((non_blocking && errno == EAGAIN) || errno == EINTR));
+
+	return result;
+
+}
+
+
+static ssize_t receive_message(enum transport transport, int fd, char* buffer, size_t len, int non_blocking) {
+
+	ssize_t result;
+
+	do {
+		if (transport == MQUEUE) result = mq_receive(fd, buffer, len, NULL);
+		else result = read(fd, buffer, len);
+		if (result < 0 && non_blocking && errno == EAGAIN) sched_yield();	// Let the other side run on a busy CPU
+	} while (result < 0 && ((non_blocking && errno == EAGAIN) || errno == EINTR));
+
+	return result;
+
+}
+
+
+static void* producer(void* arg) {
+
+	struct worker* w = arg;
+	struct channel* ch = &w->channel[w->id % w->config->slots];
+	char* buffer = calloc(1, w->config->size);
+	__u64 stamp;
+	long i;
+
+	while (!w->shared->go) sched_yield();
+
+	for (i = 0; i < w->config->count; i++) {
+		stamp = now_ns();
+		memcpy(buffer, &stamp, STAMP_SIZE);
+		if (send_message(w->transport, ch->out, buffer, w->config->size, w->config->non_blocking) != (ssize_t) w->config->size) {
+			perror("send");
+			break;
+		}
+	}
+
+	free(buffer);
+
+	return NULL;
+
+}
+
+
+static void* consumer(void* arg) {
+
+	struct worker* w = arg;
+	struct channel* ch = &w->channel[w->id % w->config->slots];
+	char* buffer = malloc(w->config->size);
+	__u64 stamp, received;
+	long sample;
+
+	while (!w->shared->go) sched_yield();
+
+	for (;;) {
+		if (receive_message(w->transport, ch->in, buffer, w->config->size, w->config->non_blocking) != (ssize_t) w->config->size) {
+			perror("receive");
+			break;
+		}
+		received = now_ns();
+		memcpy(&stamp, buffer, STAMP_SIZE);
+		if (stamp == 0) break;	// End of the run
+		sample = __atomic_fetch_add(&w->shared->next_sample, 1, __ATOMIC_RELAXED);
+		if (sample < w->shared->capacity) w->shared->samples[sample] = received - stamp;
+	}
+
+	free(buffer);
+
+	return NULL;
+
+}
+
+
+/* Create the channels of a run. Returns 0, or -1 if the transport is not available. */
+static int open_channels(enum transport transport, struct config* config, struct channel* channels) {
+
+	struct mailslot_create create;
+	struct mq_attr attr;
+	char path[64];
+	int i, j, control, fds[2], flags = config->non_blocking ? O_NONBLOCK : 0, buffering = config->storage;
+	long max_msgs = 10;
+	FILE* limit;
+
+	for (i = 0; i < config->slots; i++) channels[i].in = channels[i].out = channels[i].minor = -1;
+
+	switch (transport) {
+
+		case MAILSLOT:
+			if (config->device) {	// A single existing slot, reconfigured for the workload
+				channels[0].in = channels[0].out = open(config->device, O_RDWR | flags);
+				if (channels[0].in < 0) return -1;
+				if (ioctl(channels[0].in, SET_MAXIMUM_MSG_SIZE, config->size) < 0 || ioctl(channels[0].in, SET_MAILSLOT_STORAGE, config->storage) < 0)
+					perror("mailslot configuration");
+				return 0;
+			}
+
+			control = open(CONTROL_DEVICE, O_RDWR);
+			if (control < 0) return -1;
+
+			for (i = 0; i < config->slots; i++) {
+				memset(&create, 0, sizeof(create));
+				create.minor = MAILSLOT_ANY_MINOR;
+				create.max_msg_size = config->size;
+				create.storage = config->storage;
+				create.engine = MAILSLOT_ENGINE_LIST;
+				create.numa_node = MAILSLOT_NUMA_AUTO;
+				if (ioctl(control, MAILSLOT_CTL_CREATE, &create) < 0) break;
+				channels[i].minor = create.minor;
+				snprintf(path, sizeof(path), DEVICE_DIR "%s", create.name);
+				for (j = 0; j < NODE_ATTEMPTS && (channels[i].in = open(path, O_RDWR | flags)) < 0 && errno == ENOENT; j++) usleep(1000);
+				if (channels[i].in < 0) break;
+				channels[i].out = channels[i].in;
+			}
+
+			close(control);
+			return i == config->slots ? 0 : -1;
+
+		case PIPE:
+			if (config->size > PIPE_BUF) return -1;	// Larger writes are not atomic: messages would interleave
+			for (i = 0; i < config->slots; i++) {
+				if (pipe2(fds, flags) < 0) return -1;
+				channels[i].in = fds[0];
+				channels[i].out = fds[1];
+				fcntl(fds[1], F_SETPIPE_SZ, (int) config->storage);	// Best effort: rounded up, and capped for unprivileged users
+			}
+			return 0;
+
+		case MQUEUE:
+			limit = fopen(MQUEUE_MAX_PATH, "r");
+			if (limit) {
+				if (fscanf(limit, "%ld", &max_msgs) != 1) max_msgs = 10;
+				fclose(limit);
+			}
+			attr.mq_flags = 0;
+			attr.mq_maxmsg = config->storage / config->size < (size_t) max_msgs ? (long) (config->storage / config->size) : max_msgs;
+			if (attr.mq_maxmsg < 1) attr.mq_maxmsg = 1;
+			attr.mq_msgsize = config->size;
+			attr.mq_curmsgs = 0;
+			for (i = 0; i < config->slots; i++) {
+				snprintf(path, sizeof(path), "/mailslot-benchmark-%d-%d", (int) getpid(), i);
+				channels[i].in = channels[i].out = mq_open(path, O_RDWR | O_CREAT | O_EXCL | flags, 0600, &attr);
+				if (channels[i].in < 0) return -1;
+				mq_unlink(path);	// Released with its last descriptor
+			}
+			return 0;
+
+		case UNIX_SEQPACKET:
+			for (i = 0; i < config->slots; i++) {
+				if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) return -1;
+				channels[i].out = fds[0];
+				channels[i].in = fds[1];
+				setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buffering, sizeof(buffering));
+				if (flags) {
+					fcntl(fds[0], F_SETFL, O_NONBLOCK);
+					fcntl(fds[1], F_SETFL, O_NONBLOCK);
+				}
+			}
+			return 0;
+
+		default:
+			return -1;
+	}
+
+}
+
+
+static void close_channels(enum transport transport, struct config* config, struct channel* channels) {
+
+	int i, control;
+
+	for (i = 0; i < config->slots; i++) {
+		if (channels[i].in >= 0) close(channels[i].in);
+		if (channels[i].out >= 0 && channels[i].out != channels[i].in) close(channels[i].out);
+	}
+
+	if (transport != MAILSLOT || config->device) return;
+
+	control = open(CONTROL_DEVICE, O_RDWR);
+	if (control < 0) return;
+
+	for (i = 0; i < config->slots; i++)
+		if (channels[i].minor >= 0 && ioctl(control, MAILSLOT_CTL_DESTROY, channels[i].minor) < 0) perror("mailslot destruction");
+
+	close(control);
+
+}
+
+
+static int compare_samples(const void* a, const void* b) {
+
+	__u64 x = *(const __u64*) a, y = *(const __u64*) b;
+
+	return x < y ? -1 : x > y;
+
+}
+
+
+static void start_worker(struct worker* w, void* (*body)(void*)) {
+
+	if (!w->config->processes) {
+		pthread_create(&w->thread, NULL, body, w);
+		return;
+	}
+
+	w->pid = fork();
+	if (w->pid == 0) {
+		body(w);
+		_exit(0);
+	}
+
+}
+
+
+static void join_worker(struct worker* w) {
+
+	if (w->config->processes) waitpid(w->pid, NULL, 0);
+	else pthread_join(w->thread, NULL);
+
+}
+
+
+/* Run the workload on a transport and print its line of results */
+static void run(enum transport transport, struct config* config) {
+
+	struct channel channels[MAX_SLOTS];
+	struct worker workers[2 * MAX_WORKERS];
+	struct shared* shared;
+	long total = config->producers * config->count, samples;
+	size_t shared_size = sizeof(struct shared) + total * sizeof(__u64);
+	char* poison = calloc(1, config->size);
+	__u64 start, elapsed;
+	double seconds;
+	int i, error;
+
+	errno = 0;
+	if (open_channels(transport, config, channels) < 0) {
+		error = errno;
+		printf("%-9s not available (%s)\n", transport_names[transport], error ? strerror(error) : "unsupported size");
+		close_channels(transport, config, channels);
+		free(poison);
+		return;
+	}
+
+	shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	shared->capacity = total;
+
+	for (i = 0; i < config->producers + config->consumers; i++) {
+		workers[i].id = i < config->producers ? i : i - config->producers;
+		workers[i].transport = transport;
+		workers[i].config = config;
+		workers[i].channel = channels;
+		workers[i].shared = shared;
+		start_worker(&workers[i], i < config->producers ? producer : consumer);
+	}
+
+	start = now_ns();
+	__atomic_store_n(&shared->go, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < config->producers; i++) join_worker(&workers[i]);
+
+	// Everything is queued: one end marker per consumer, behind the messages of its channel
+	for (i = 0; i < config->consumers; i++)
+		send_message(transport, channels[i % config->slots].out, poison, config->size, config->non_blocking);
+
+	for (i = config->producers; i < config->producers + config->consumers; i++) join_worker(&workers[i]);
+
+	elapsed = now_ns() - start;
+	seconds = elapsed / 1e9;
+
+	samples = shared->next_sample < total ? shared->next_sample : total;
+	qsort(shared->samples, samples, sizeof(__u64), compare_samples);
+
+	printf("%-9s %12.0f %10.2f %10.2f %10.2f %10.2f%s\n", transport_names[transport], samples / seconds,
+		samples * (double) config->size / seconds / 1e6,
+		samples ? shared->samples[samples * 50 / 100] / 1e3 : 0.0,
+		samples ? shared->samples[samples * 99 / 100] / 1e3 : 0.0,
+		samples ? shared->samples[samples * 999 / 1000] / 1e3 : 0.0,
+		samples < total ? "  (messages lost)" : "");
+
+	munmap(shared, shared_size);
+	close_channels(transport, config, channels);
+	free(poison);
+
+}
+
+
+static void usage(const char* name) {
+
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -t LIST   transports, comma separated: mailslot,pipe,mq,unix (default: all)\n"
+		"  -p N      producers (default: 1)\n"
+		"  -c N      consumers (default: 1)\n"
+		"  -s N      slots, i.e. independent channels, at most min(producers, consumers) (default: 1)\n"
+		"  -n N      messages per producer (default: 100000)\n"
+		"  -m N      message size in bytes, at least %zu (default: 64)\n"
+		"  -b N      buffering of a channel in bytes (default: 65536)\n"
+		"  -N        non-blocking mode, retrying on EAGAIN after yielding the CPU\n"
+		"  -P        processes instead of threads\n"
+		"  -d PATH   existing mailslot device, instead of creating slots through " CONTROL_DEVICE " (implies -s 1)\n",
+		name, STAMP_SIZE);
+
+	exit(EXIT_FAILURE);
+
+}
+
+
+int main(int argc, char** argv) {
+
+	struct config config = { 1, 1, 1, 100000, 64, 65536, 0, 0, NULL, (1 << TRANSPORTS) - 1 };
+	char* name;
+	int option, i;
+
+	while ((option = getopt(argc, argv, "t:p:c:s:n:m:b:NPd:")) != -1) {
+		switch (option) {
+			case 't':
+				config.transports = 0;
+				for (name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+					for (i = 0; i < TRANSPORTS && strcmp(name, transport_names[i]); i++);
+					if (i == TRANSPORTS) usage(argv[0]);
+					config.transports |= 1 << i;
+				}
+				break;
+			case 'p': config.producers = atoi(optarg); break;
+			case 'c': config.consumers = atoi(optarg); break;
+			case 's': config.slots = atoi(optarg); break;
+			case 'n': config.count = atol(optarg); break;
+			case 'm': config.size = strtoul(optarg, NULL, 0); break;
+			case 'b': config.storage = strtoul(optarg, NULL, 0); break;
+			case 'N': config.non_blocking = 1; break;
+			case 'P': config.processes = 1; break;
+			case 'd': config.device = optarg; config.slots = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+
+	if (config.producers < 1 || config.producers > MAX_WORKERS || config.consumers < 1 || config.consumers > MAX_WORKERS ||
+		config.slots < 1 || config.slots > MAX_SLOTS || config.slots > config.producers || config.slots > config.consumers ||
+		config.count < 1 || config.size < STAMP_SIZE || config.storage < config.size)
+		usage(argv[0]);
+
+	setbuf(stdout, NULL);
+	printf("**  BENCHMARK FOR LINUX MAILSLOT V. %s **\n\n", VERSION);
+	printf("%d producer(s), %d consumer(s) (%s), %d slot(s), %ld messages of %zu bytes per producer, %zu bytes of buffering, %s\n\n",
+		config.producers, config.consumers, config.processes ? "processes" : "threads", config.slots, config.count, config.size,
+		config.storage, config.non_blocking ? "non-blocking" : "blocking");
+	printf("%-9s %12s %10s %10s %10s %10s\n", "transport", "msgs/s", "MB/s", "p50 us", "p99 us", "p999 us");
+
+	for (i = 0; i < TRANSPORTS; i++) {
+		if (config.transports & (1 << i)) run(i, &config);
+	}
+
+	return 0;
+
+}
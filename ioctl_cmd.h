@@ -1,7 +1,210 @@
 #include <linux/ioctl.h>	// IOCTL setting utility
+#include <linux/types.h>	// Fixed-size types shared with userspace
 
 #define IOCTL_DRIVER_NUM 75	// Arbitrary number unique in the system
 
 #define SET_BLOCKING _IO(IOCTL_DRIVER_NUM, 2)
 #define SET_NONBLOCKING _IO(IOCTL_DRIVER_NUM, 5)
 #define SET_MAXIMUM_MSG_SIZE _IOW(IOCTL_DRIVER_NUM, 7, int)
+
+/* What a write to a full mailslot does (argument: MAILSLOT_OVERFLOW_*). With the overwrite policy it always succeeds:
+   the oldest queued messages (with priorities, those of the lowest priority first) are evicted unread to make room,
+   and counted as dropped in the statistics. Not available with the shared engine and the SPSC, sharded and broadcast modes. */
+#define SET_OVERFLOW_POLICY _IOW(IOCTL_DRIVER_NUM, 37, int)
+
+#define MAILSLOT_OVERFLOW_BLOCK 0	// Wait for room, or fail with EAGAIN (default)
+#define MAILSLOT_OVERFLOW_OVERWRITE 1	// Evict the oldest messages
+
+#define SET_STORAGE_ENGINE _IOW(IOCTL_DRIVER_NUM, 9, int)
+
+/* Byte budget of a mailslot (argument: bytes). Messages are charged their footprint in the storage engine
+   (payload plus bookkeeping, a whole cell for the shared engine), and writers wait or get EAGAIN once the
+   next message would exceed it. The budget must hold at least one message of the maximum size. */
+#define SET_MAILSLOT_STORAGE _IOW(IOCTL_DRIVER_NUM, 21, int)
+#define GET_MAILSLOT_STORAGE _IOR(IOCTL_DRIVER_NUM, 23, __u64)
+
+/* Storage engines (argument of SET_STORAGE_ENGINE). The ring and shared engines take messages of up to 16 pages
+   (64 KiB with 4 KiB pages): larger maximum message sizes fail with EINVAL there. */
+#define MAILSLOT_ENGINE_LIST 0	// One heap-allocated node per message (default)
+#define MAILSLOT_ENGINE_RING 1	// Preallocated contiguous byte ring, no allocation per message
+#define MAILSLOT_ENGINE_SHARED 2	// Ring of fixed-size cells that can be mapped in userspace (see below)
+
+/* Single-producer/single-consumer mode of the ring engine (argument: 1 on, 0 off). read() and write() no longer take
+   the mailslot lock, so a non-blocking call only fails with EAGAIN when the ring is really empty or full. At most one
+   reader and one writer may be active at a time: a second concurrent one fails with EBUSY. */
+#define SET_SPSC_MODE _IOW(IOCTL_DRIVER_NUM, 19, int)
+
+/* Sharded mode of an empty list engine mailslot (argument: 1 on, 0 off), for many writers on many CPUs. Each CPU has its
+   own FIFO and lock: write() appends to the one of its CPU, read() takes from the one of its CPU first and steals from
+   the others when it is empty. Messages written from the same CPU (so from a producer that is not migrated) keep their
+   order, but there is no global FIFO order, and priorities are ignored. Splice and the broadcast mode are not supported. */
+#define SET_SHARDED_MODE _IOW(IOCTL_DRIVER_NUM, 39, int)
+
+/* NUMA node of a mailslot (argument: node, or MAILSLOT_NUMA_AUTO). The payloads of the list engine are allocated on it,
+   and the ring and broadcast storage when they are (re)allocated. By default (see the numa_node module parameter) the
+   payloads follow the readers: they are allocated on the node of the last one. */
+#define SET_NUMA_NODE _IOW(IOCTL_DRIVER_NUM, 41, int)
+
+#define MAILSLOT_NUMA_AUTO (-1)
+
+/* Read mode of the file (argument: MAILSLOT_READ_* flags, 0 for one message per read()). It only applies to
+   the file it is set on, not to the other sessions of the mailslot. */
+#define SET_READ_MODE _IOW(IOCTL_DRIVER_NUM, 25, int)
+
+/* Drain mode: a read()/readv() returns as many whole messages as fit the buffer, taken with a single lock hold.
+   Each message is preceded by its length as a native-endian __u32, with no padding; EMSGSIZE only if not even
+   the first message fits. */
+#define MAILSLOT_READ_DRAIN 0x1
+
+/* Truncating mode: a message longer than the buffer is delivered cut to the buffer size and the rest is discarded;
+   read() returns the whole length of the message, as recv() with MSG_TRUNC. It can't be combined with the drain mode. */
+#define MAILSLOT_READ_TRUNC 0x2
+
+/* State of a mailslot, without dequeuing anything (as GetMailslotInfo()). With several readers the next message
+   may be taken by another one before this caller reads it, so next_size is only exact for a single reader. */
+#define MAILSLOT_GET_INFO _IOR(IOCTL_DRIVER_NUM, 27, struct mailslot_info)
+
+#define MAILSLOT_NO_MESSAGE ((__u32) -1)
+
+struct mailslot_info {
+	__u32 max_msg_size;		// Maximum message size
+	__u32 next_size;		// Length of the next message, MAILSLOT_NO_MESSAGE if the mailslot is empty
+	__u32 msg_count;		// Queued messages
+	__u32 reserved;
+};
+
+/* Busy polling of the blocking reads of the file (argument: microseconds, 0 to turn it off, at most 10000). An empty
+   mailslot is polled for up to that long before the reader sleeps, trading CPU time for the wakeup latency. */
+#define SET_BUSY_POLL _IOW(IOCTL_DRIVER_NUM, 29, int)
+
+/* Priority of the messages written through the file (argument: 0 to MAILSLOT_PRIORITIES - 1, default 0). The list
+   engine keeps a FIFO per priority and always delivers from the highest non-empty one; the ring and shared engines
+   are a single FIFO and ignore it. */
+#define SET_WRITE_PRIORITY _IOW(IOCTL_DRIVER_NUM, 31, int)
+
+#define MAILSLOT_PRIORITIES 8
+
+/* Broadcast mode of a list engine mailslot (argument: MAILSLOT_BROADCAST_*), which can only be turned on or off while
+   it holds no messages. Every message is delivered to each file subscribed with MAILSLOT_SUBSCRIBE when it is written:
+   it is stored once, and released when the last of them has read it. Messages written with no subscribers are
+   discarded. Subscribers read at their own pace, in write order (priorities are ignored), up to MAILSLOT_BROADCAST_DEPTH
+   messages behind the writers. A read of a file that is not subscribed fails with EPIPE; batches, splice and the
+   drain read mode are not supported. */
+#define SET_BROADCAST_MODE _IOW(IOCTL_DRIVER_NUM, 33, int)
+#define MAILSLOT_SUBSCRIBE _IOW(IOCTL_DRIVER_NUM, 35, int)	// Argument: 1 to subscribe the file, 0 to unsubscribe it
+
+#define MAILSLOT_BROADCAST_OFF 0
+#define MAILSLOT_BROADCAST_BLOCK 1	// Writers wait for the slowest subscriber to make room
+#define MAILSLOT_BROADCAST_DROP 2	// The slowest subscribers are unsubscribed to make room
+#define MAILSLOT_BROADCAST_DEPTH 1024
+
+/* Batched transfers: up to MAILSLOT_BATCH_MAX messages with one syscall, one lock acquisition and one wakeup.
+   The ioctl returns the number of messages transferred, or -1 (errno set) if none could be. Both can also be queued
+   through io_uring as IORING_OP_URING_CMD, with the command in cmd_op and the struct mailslot_batch (whose done field
+   is not written) in the command area of the SQE: the completion carries the number of messages transferred, or
+   -errno; a batch that has to wait does so in an io_uring worker. Plain reads and writes through io_uring wait for the
+   mailslot with poll instead, without tying up a thread. */
+#define MAILSLOT_SEND_BATCH _IOWR(IOCTL_DRIVER_NUM, 11, struct mailslot_batch)
+#define MAILSLOT_RECV_BATCH _IOWR(IOCTL_DRIVER_NUM, 13, struct mailslot_batch)
+
+#define MAILSLOT_BATCH_MAX 64
+
+/* One message of a batch */
+struct mailslot_msg {
+	__u64 buffer;	// User buffer address
+	__u32 length;	// Send: message length. Receive: buffer size
+	__u32 flags;	// MAILSLOT_MSG_* flags, 0 otherwise
+	__s64 result;	// Out: bytes transferred, -errno for the message that stopped the batch, 0 if not attempted
+};
+
+/* Send: the message has the priority in the low byte of flags, instead of the one of the file. Receive (out, list
+   engine): set, with the priority of the message in the low byte. */
+#define MAILSLOT_MSG_PRIORITY 0x100
+#define MAILSLOT_MSG_PRIORITY_MASK 0xff
+
+/* Argument of MAILSLOT_SEND_BATCH and MAILSLOT_RECV_BATCH */
+struct mailslot_batch {
+	__u64 msgs;		// Address of an array of struct mailslot_msg
+	__u32 count;	// Number of entries in the array
+	__u32 done;		// Out: number of messages transferred
+};
+
+/* Receive from several mailslots at once, as WaitForMultipleObjects(): the mailslots of the count file descriptors
+   at fds (each opened on a mailslot) are tried in order, and the first message found is read into the buffer, as
+   read() on that file would (with its read mode). If all of them are empty the caller waits for any of them to get a
+   message, or fails with EAGAIN with the non-blocking policy of the file the ioctl is issued on. Returns the bytes
+   read, or -1 (errno set); index and minor tell which mailslot the message, or the error, comes from. */
+#define MAILSLOT_RECV_ANY _IOWR(IOCTL_DRIVER_NUM, 43, struct mailslot_recv_any)
+
+#define MAILSLOT_WAIT_MAX 64
+
+struct mailslot_recv_any {
+	__u64 fds;		// Address of an array of __s32 file descriptors
+	__u32 count;	// Number of entries in the array
+	__u32 index;	// Out: entry of the mailslot read
+	__u64 buffer;	// User buffer address
+	__u32 length;	// Buffer size
+	__u32 minor;	// Out: minor number of the mailslot read
+};
+
+/* Control device (/dev/mailslot-ctl, administrator only). MAILSLOT_CTL_CREATE creates a mailslot with its parameters
+   set up front, and its device node; it then stays allocated, even with no open files, until MAILSLOT_CTL_DESTROY
+   (argument: minor) releases it, which fails with EBUSY while it is open. Mailslots that are not created this way are
+   still allocated with the default parameters on their first open(). */
+#define MAILSLOT_CTL_CREATE _IOWR(IOCTL_DRIVER_NUM, 45, struct mailslot_create)
+#define MAILSLOT_CTL_DESTROY _IOW(IOCTL_DRIVER_NUM, 47, int)
+
+#define MAILSLOT_ANY_MINOR ((__u32) -1)
+
+struct mailslot_create {
+	__u32 minor;		// Minor to create, or MAILSLOT_ANY_MINOR for the first free one. Out: minor of the mailslot
+	__u32 major;		// Out: major of the mailslots
+	__u32 max_msg_size;	// Maximum message size, 0 for the default
+	__u32 storage;		// Byte budget (see SET_MAILSLOT_STORAGE), 0 for the default
+	__u32 engine;		// MAILSLOT_ENGINE_*
+	__u32 overflow;		// MAILSLOT_OVERFLOW_*
+	__s32 numa_node;	// Node of the mailslot (see SET_NUMA_NODE), or MAILSLOT_NUMA_AUTO
+	__u32 reserved;
+	char name[32];		// Out: name of the device node, in /dev
+};
+
+/* Shared ring (MAILSLOT_ENGINE_SHARED). After selecting the engine, a process maps MAILSLOT_GET_MAP_SIZE bytes
+   of the device at offset 0 and exchanges messages without syscalls, using the bounded MPMC queue protocol below
+   (the kernel read()/write() paths follow the same protocol, so both kinds of users share one FIFO):
+   - cells live at data_offset, cell i at data_offset + (pos & (cell_count - 1)) * cell_size; cell i starts with
+     sequence == i;
+   - produce: claim pos = producer when the cell sequence == pos (compare-and-swap on producer), write the payload
+     and length, then store sequence = pos + 1 with release semantics;
+   - consume: when the cell at pos = consumer has sequence == pos + 1, read it, then claim it with a compare-and-swap
+     on consumer (the read is only valid if the swap succeeds), then store sequence = pos + cell_count (release);
+   - a published cell with length 0 carries no message and must be consumed and skipped;
+   - after publishing, a producer issues a full fence and calls MAILSLOT_NOTIFY if read_waiters != 0; after
+     consuming, a consumer does the same with write_waiters. Syscalls are otherwise only needed to sleep. */
+#define MAILSLOT_GET_MAP_SIZE _IOR(IOCTL_DRIVER_NUM, 15, __u64)
+#define MAILSLOT_NOTIFY _IO(IOCTL_DRIVER_NUM, 17)
+
+#define MAILSLOT_SHARED_MAGIC 0x4d534c54	// "MSLT"
+
+struct mailslot_shared_header {
+	__u32 magic;
+	__u32 cell_size;		// Bytes per cell, header included
+	__u32 cell_count;		// Power of two
+	__u32 data_offset;		// Offset of the first cell from the start of the mapping
+	__u32 max_msg_size;		// Payload capacity of a cell
+	__u32 reserved[11];
+	__u64 producer;			// Next position to be claimed by a producer
+	__u64 pad1[7];			// producer and consumer live on their own cache lines
+	__u64 consumer;			// Next position to be claimed by a consumer
+	__u64 pad2[7];
+	__u32 read_waiters;		// Non-zero while somebody may sleep waiting for messages
+	__u32 write_waiters;	// Non-zero while somebody may sleep waiting for room
+	__u64 pad3[7];
+};
+
+struct mailslot_shared_cell {
+	__u64 sequence;
+	__u32 length;			// Payload bytes, 0 for a cell to be skipped
+	__u32 reserved;
+	__u64 stamp;			// Enqueue time (CLOCK_MONOTONIC, ns), 0 if unknown
+	// Payload follows
+};
@@ -1,72 +1,377 @@
-
 /**********************************************************************************************
 * Char devices' driver that implement a module Linux that offers a service similar to those   *
-* that are offered by Windows "Mailslots". It handles up to 256 different instances that can  *
-* be concurrently accessed by active threads. The runtime behaviour of a mailslot can be      *
-* changed through IOCTL commands (e.g. max message size per mailslot) or change the behaviour *
-* of any I/O session targeting it (blocking/non-blocking policies).                           *
+* that are offered by Windows "Mailslots". It handles up to 256 different instances (by       *
+* default, see the module parameters) that can be concurrently accessed by active threads.    *
+* The runtime behaviour of a mailslot can be changed through IOCTL commands (e.g. max message *
+* size per mailslot) or change the behaviour of any I/O session targeting it                  *
+* (blocking/non-blocking policies).                                                           *
 **********************************************************************************************/
 
 /* Include headers */
+#include <linux/version.h>	// LINUX_VERSION_CODE
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION( 6, 7, 0 )
+#error "The mailslot module needs Linux 6.7 or later (<linux/io_uring/cmd.h>, io_uring_sqe_cmd())"
+#endif
+
 #include <linux/kernel.h>	// printk() log level and so on
 #include <linux/module.h>	// Module support
 #include <linux/uaccess.h>	// For controlled transfer from/to userspace
 #include <linux/slab.h>		// kzalloc() and kfree()
+#include <linux/mm.h>		// kvmalloc() and kvfree() for the ring storage
+#include <linux/vmalloc.h>	// vmalloc_user() for the shared ring
+#include <linux/rcupdate.h>	// Lockless readers of the shared ring pointer
+#include <linux/log2.h>		// roundup_pow_of_two()
+#include <linux/pagemap.h>	// fault_in_readable() and fault_in_writeable()
+#include <linux/uio.h>		// struct iov_iter, for read_iter/write_iter
 #include <linux/fs.h>		// For struct file_operations and others
 #include <linux/cdev.h>		// Character devices
+#include <linux/miscdevice.h>	// Control device
+#include <linux/device.h>	// Device nodes of the slots created through the control device
 #include <linux/mutex.h>	// Atomic access to resources
+#include <linux/spinlock.h>	// Producer and consumer locks
+#include <linux/jump_label.h>	// Static key gating the debug messages
+#include <linux/moduleparam.h>	// Module parameters
+#include <linux/ktime.h>	// Timestamps for the latency histograms and the tracepoints
+#include <linux/poll.h>		// poll/select/epoll support
+#include <linux/xarray.h>	// Instances, allocated on demand
+#include <linux/list.h>		// Subscribers of a broadcast mailslot
+#include <linux/percpu.h>	// Per-CPU performance counters and shards
+#include <linux/cpumask.h>	// Work stealing across the shards
+#include <linux/nodemask.h>	// NUMA placement of the slot state and of the payloads
+#include <linux/debugfs.h>	// Counters export
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>	// local_clock() for the busy polling budget
+#include <linux/sched/signal.h>
+#include <linux/file.h>		// fget() of the mailslots of a wait on several of them
+#include <linux/highmem.h>	// kmap_local_page() for the page-backed payloads
+#include <linux/splice.h>	// splice_read/splice_write
+#include <linux/pipe_fs_i.h>
+#include <linux/io_uring/cmd.h>	// Batches submitted through io_uring
 
 #include "ioctl_cmd.h"		// IOCTL commands, author's defined
 
+#define CREATE_TRACE_POINTS
+#include "mailslot_trace.h"	// Tracepoints, author's defined
+
 /* Module details */
 MODULE_AUTHOR( "Riccardo Vecchi <vecchi.1467420@studenti.uniroma1.it>" );
 MODULE_DESCRIPTION( "A Linux kernel subsystem services similar to those that are offered by Windows \"Mailslots\"" );
 MODULE_VERSION( "1.0" );
 MODULE_LICENSE( "GPL" );
 
-/* Parameters */
+/* Parameters: defaults of the module parameters of the same (lowercase) name */
 #define DEVICE_NAME "mailslot"
 #define FIRST_MINOR 0
 #define INSTANCES 256
-#define MAILSLOT_STORAGE 64
+#define MAILSLOT_STORAGE 8192
 #define DEFAULT_MESSAGE_SIZE 128
-#define MAXIMUM_MESSAGE_SIZE 512
+#define MAXIMUM_MESSAGE_SIZE ( 4 << 20 )
+
+/* Latency histograms: bucket 0 counts the times below 2^LATENCY_SHIFT ns, bucket i those in
+   [2^(i-1), 2^i) << LATENCY_SHIFT ns, and the last bucket everything above (about 4 s) */
+#define LATENCY_SHIFT 10
+#define LATENCY_BUCKETS 24
+
+/* Sanity bounds of the module parameters */
+#define STORAGE_LIMIT ( 1 << 30 )
+#define MESSAGE_SIZE_LIMIT ( 64 << 20 )
+
+/* Largest message of the ring and shared engines, whose records are copied with a queue spinlock held */
+#define RING_MESSAGE_LIMIT ( PAGE_SIZE * 16 )
+
+/* Longest busy polling budget of a session, in microseconds */
+#define BUSY_POLL_LIMIT 10000
 
 #define BLOCKING 0
 #define NONBLOCKING 1
 
 #define SUCCESS 0
 
+/* Ring engine: each message is stored as a header followed by the payload, padded so that
+   headers never straddle the end of the ring */
+#define RING_RECORD_ALIGN sizeof(struct ring_header)
+#define RING_RECORD_SIZE(len) ( sizeof(struct ring_header) + ALIGN( (size_t) (len), RING_RECORD_ALIGN ) )
+
+/* List engine: footprint of a message, charged to the byte budget of the mailslot. Payloads larger than
+   MESSAGE_INLINE_MAX are kept in a list of pages instead of a single contiguous allocation. */
+#define LIST_FOOTPRINT(len) ( sizeof(struct message) + ( (len) > MESSAGE_INLINE_MAX ? PAGE_ALIGN( (size_t) (len) ) : (size_t) (len) ) )
+#define MESSAGE_INLINE_MAX PAGE_SIZE
+
+/* Broadcast mode: slot of the retention ring holding the message of sequence number seq */
+#define BROADCAST_SLOT(seq) ( (seq) & (MAILSLOT_BROADCAST_DEPTH - 1) )
+
+/* Drain read mode: each message is preceded by its length */
+#define FRAME_HEADER sizeof(u32)
+
+/* Shared engine: cells are cache-line aligned and follow a header page. A compare-and-swap that keeps
+   failing (userspace racing, or misbehaving) is given up after SHARED_ATTEMPTS tries. */
+#define SHARED_CELL_SIZE(len) ALIGN( sizeof(struct mailslot_shared_cell) + (len), SMP_CACHE_BYTES )
+#define SHARED_ATTEMPTS 64
+
+/* SPSC mode: bits of spsc_busy. Each lockless operation owns its side's bit while it runs; a configuration
+   change raises SPSC_CONFIG, which sends the operations to the locked path, and then takes the other two. */
+#define SPSC_PRODUCER 0
+#define SPSC_CONSUMER 1
+#define SPSC_CONFIG 2
+#define SPSC_QUIESCED ( BIT( SPSC_PRODUCER ) | BIT( SPSC_CONSUMER ) | BIT( SPSC_CONFIG ) )
+
+/* Per-operation diagnostics: compiled in, but a patched-out branch unless the "debug" parameter is set */
+#define debug_printk( ... ) ( static_branch_unlikely( &debug_key ) ? printk( __VA_ARGS__ ) : 0 )
+
 /* Prototypes */
+struct mailslot;
+struct session;
+struct message;
+struct shared_ring;
+struct mailslot_shard;
+struct mailslot_counters;
 int init_module( void );
 void cleanup_module( void );
 static int mailslot_open( struct inode*, struct file* );
 static int mailslot_release( struct inode*, struct file* );
-static ssize_t mailslot_read( struct file*, char*, size_t, loff_t* );
-static ssize_t mailslot_write( struct file*, const char*, size_t, loff_t* );
+static ssize_t mailslot_read_iter( struct kiocb*, struct iov_iter* );
+static ssize_t mailslot_write_iter( struct kiocb*, struct iov_iter* );
+static ssize_t mailslot_splice_read( struct file*, loff_t*, struct pipe_inode_info*, size_t, unsigned int );
+static ssize_t mailslot_splice_write( struct pipe_inode_info*, struct file*, loff_t*, size_t, unsigned int );
+static int __splice_actor( struct pipe_inode_info*, struct pipe_buffer*, struct splice_desc* );
 static long mailslot_ioctl( struct file*, unsigned int, unsigned long );
+static __poll_t mailslot_poll( struct file*, poll_table* );
+static int mailslot_mmap( struct file*, struct vm_area_struct* );
+static int mailslot_uring_cmd( struct io_uring_cmd*, unsigned int );
+static struct mailslot_msg* __batch_fetch( struct mailslot_batch*, unsigned int* );
+static long __batch_finish( struct mailslot_batch*, __u32 __user*, struct mailslot_msg*, unsigned int, long );
+static long __mailslot_send_batch( struct file*, struct mailslot_batch*, __u32 __user*, int );
+static long __mailslot_recv_batch( struct file*, struct mailslot_batch*, __u32 __user*, int );
+static long __mailslot_recv_any( struct mailslot*, struct mailslot_recv_any __user*, int );
+static int __recv_any_ready( struct file* );
+static long mailslot_ctl_ioctl( struct file*, unsigned int, unsigned long );
+static long __ctl_create( struct mailslot_create __user* );
+static long __ctl_destroy( unsigned long );
 static void __deallocate_instances( void );
 static int __get_slot( struct file* );
+static struct session* __get_session( struct file* );
+static struct mailslot* __get_mailslot( struct file* );
+static struct mailslot* __mailslot_alloc( int, int );
+static void __mailslot_free( struct mailslot* );
+static int __mailslot_idle( struct mailslot* );
+static void __account_enqueue( struct mailslot*, size_t );
+static void __account_dequeue( struct mailslot*, size_t, u64 );
+static void __account_numa( struct mailslot*, struct message* );
+static int __message_node( struct mailslot* );
+static int __latency_bucket( u64 );
+static long __account_error( struct mailslot*, long );
+static void __account_wake( struct mailslot*, int, u64 );
+static void __counters_sum( struct mailslot*, struct mailslot_counters* );
+static void __counters_read( struct mailslot*, struct mailslot_counters* );
+static void __counters_add( struct mailslot_counters*, struct mailslot_counters* );
+static void __counters_print( struct seq_file*, struct mailslot_counters* );
+static int mailslot_stats_show( struct seq_file*, void* );
+static void __latency_print( struct seq_file*, const char*, const char*, u64* );
+static int mailslot_latency_show( struct seq_file*, void* );
+static ssize_t mailslot_stats_reset( struct file*, const char __user*, size_t, loff_t* );
 static int __get_blocking_policy( struct file* );
-static int __mailslot_lock( int, int ); 
-static void __mailslot_unlock( int );
+static int __mailslot_lock( struct mailslot*, int ); 
+static void __mailslot_unlock( struct mailslot* );
+static void __consumer_lock( struct mailslot* );
+static void __consumer_unlock( struct mailslot* );
+static void __producer_lock( struct mailslot* );
+static void __producer_unlock( struct mailslot* );
+static void __queue_lock_both( struct mailslot* );
+static void __queue_unlock_both( struct mailslot* );
+static int __wait_readable( struct mailslot*, int, unsigned int );
+static int __busy_poll( struct mailslot*, unsigned int );
+static void __wake_readers( struct mailslot*, int );
+static void __wake_writers( struct mailslot*, int );
+static int __wait_writable( struct mailslot*, size_t, int );
+static int __mailslot_full( struct mailslot*, size_t );
+static int __mailslot_empty( struct mailslot* );
+static int __mailslot_depth( struct mailslot* );
+static u32 __mailslot_peek( struct mailslot* );
+static int __wait_readable_cond( struct mailslot* );
+static int __wait_writable_cond( struct mailslot*, size_t );
+static int __mailslot_reconfigure( struct mailslot*, int, size_t, size_t );
+static size_t __message_footprint( int, size_t );
+static ssize_t __lockless_read( struct mailslot*, struct iov_iter*, unsigned int, int, int, unsigned int );
+static ssize_t __lockless_write( struct mailslot*, struct iov_iter*, int, int );
+static ssize_t __spsc_read( struct mailslot*, struct iov_iter*, unsigned int, int, int, unsigned int );
+static ssize_t __spsc_write( struct mailslot*, struct iov_iter*, int, int );
+static void __spsc_quiesce( struct mailslot* );
+static void __spsc_resume( struct mailslot* );
+static struct message* __message_build( struct mailslot*, struct iov_iter*, unsigned int, int );
+static void __message_free( struct message* );
+static struct message* __message_alloc( size_t, int, int, int );
+static void __message_trim( struct message* );
+static size_t __message_copy_in( struct message*, struct iov_iter* );
+static size_t __message_copy_out( struct message*, struct iov_iter*, unsigned int );
+static void __list_link( struct mailslot*, struct message* );
+static int __list_lane( struct mailslot* );
+static struct message* __list_peek( struct mailslot* );
+static struct message* __list_unlink( struct mailslot*, int );
+static void __list_push_front( struct mailslot*, struct message* );
+static void __list_release( struct mailslot*, struct message* );
+static void __message_free_chain( struct message* );
+static ssize_t __ring_dequeue( struct mailslot*, struct iov_iter*, unsigned int, u64* );
+static int __ring_enqueue( struct mailslot*, struct iov_iter* );
+static ssize_t __mailslot_read( struct kiocb*, struct iov_iter* );
+static ssize_t __mailslot_drain( struct mailslot*, struct iov_iter*, int, unsigned int );
+static ssize_t __mailslot_write( struct kiocb*, struct iov_iter* );
+static u64 __enqueue_stamp( void );
+static int __ring_empty( struct mailslot* );
+static int __ring_full( struct mailslot*, size_t );
+static ssize_t __inplace_dequeue( struct mailslot*, struct iov_iter*, unsigned int, u64* );
+static int __inplace_enqueue( struct mailslot*, struct iov_iter* );
+static struct mailslot_shared_cell* __shared_cell( struct shared_ring*, u64 );
+static ssize_t __shared_dequeue( struct mailslot*, struct iov_iter*, unsigned int, u64* );
+static int __shared_enqueue( struct mailslot*, struct iov_iter* );
+static int __shared_empty( struct mailslot* );
+static int __shared_full( struct mailslot* );
+static void __shared_arm( struct mailslot*, int );
+static void __shared_notify( struct mailslot* );
+static int __shared_backoff( void );
+static struct shared_ring* __shared_alloc( size_t, size_t );
+static u32 __shared_cells( size_t, u32 );
+static void __shared_free( struct shared_ring* );
+static void __shared_vma_open( struct vm_area_struct* );
+static void __shared_vma_close( struct vm_area_struct* );
+static int __overflow_evict( struct mailslot*, size_t );
+static int __sharded_configure( struct mailslot*, int );
+static ssize_t __sharded_read( struct mailslot*, struct iov_iter*, unsigned int, int, int, unsigned int );
+static ssize_t __sharded_write( struct mailslot*, struct iov_iter*, int, int );
+static struct message* __shard_take( struct mailslot*, size_t, unsigned int, struct mailslot_shard** );
+static int __shard_reserve( struct mailslot*, size_t );
+static u32 __shard_peek( struct mailslot* );
+static void __ring_evict( struct mailslot* );
+static int __broadcast_configure( struct mailslot*, int );
+static int __broadcast_subscribe( struct mailslot*, struct session*, int );
+static void __broadcast_unsubscribe( struct mailslot*, struct session*, struct message** );
+static void __broadcast_put( struct mailslot*, u64, struct message** );
+static void __broadcast_drop( struct mailslot*, size_t, struct message** );
+static int __broadcast_room( struct mailslot*, size_t );
+static int __broadcast_readable( struct mailslot*, struct session* );
+static void __broadcast_info( struct mailslot*, struct session*, struct mailslot_info* );
+static ssize_t __broadcast_read( struct mailslot*, struct session*, struct iov_iter*, unsigned int, int );
+static ssize_t __broadcast_write( struct mailslot*, struct iov_iter*, int );
 
 
 /* Message struct */
 struct message {
-	char* content;
+	char* content;			// Payloads up to MESSAGE_INLINE_MAX
+	struct page** pages;	// Larger payloads, and those spliced in from a pipe
+	unsigned int nr_pages;
 	size_t length;
+	u64 stamp;		// Enqueue time (ktime_get_ns())
+	unsigned int priority;	// Lane of the message, from 0 to MAILSLOT_PRIORITIES - 1
+	unsigned int readers;	// Broadcast mode: subscribers yet to read it, plus the readers copying it
 	struct message* next;
 };
 
-/* Mailslot instance struct */
+/* Header of a ring engine record */
+struct ring_header {
+	u32 length;
+	u32 reserved;
+	u64 stamp;		// As in struct message
+};
+
+/* Shared engine area. The geometry is kept here as well, since userspace can rewrite the mapped header;
+   it never changes for the lifetime of the area, which is replaced as a whole (under RCU) when resized. */
+struct shared_ring {
+	struct mailslot_shared_header* header;	// vmalloc_user() area: header page, then the cells
+	size_t size;			// Size of the area in bytes
+	u32 cells;				// Number of cells (power of two)
+	u32 cell_size;			// Bytes per cell, header included
+	u32 msg_size;			// Payload capacity of a cell
+};
+
+/* Sharded mode: the FIFO of the messages written on a CPU. Each shard has its own lock and cache lines. */
+struct mailslot_shard {
+	spinlock_t lock;
+	struct message* head;	// Oldest message, read locklessly to skip empty shards
+	struct message* tail;
+} ____cacheline_aligned_in_smp;
+
+/* Performance counters of a mailslot, kept per CPU: the hot paths only do this_cpu_*() on them. Only
+   u64 fields, so that they can be summed as an array. Userspace operations on a mapped shared ring are
+   not seen by the driver, and so not counted. */
+struct mailslot_counters {
+	u64 msgs_in;
+	u64 bytes_in;
+	u64 msgs_out;
+	u64 bytes_out;
+	u64 eagain;				// Operations failed with -EAGAIN
+	u64 emsgsize;			// Operations failed with -EMSGSIZE
+	u64 contended;			// Queue lock acquisitions that had to spin
+	u64 blocked_ns;			// Time spent sleeping on the wait queues
+	u64 polled;				// Waits for a message that busy polling ended, without sleeping
+	u64 dropped;			// Messages evicted unread by the overwrite policy
+	u64 stolen;				// Sharded mode: messages read from the shard of another CPU
+	u64 numa_local;			// List engine: messages read on the node of their payload
+	u64 numa_remote;		// List engine: messages read from another node
+	u64 residency[LATENCY_BUCKETS];	// Enqueue to dequeue time of the messages
+	u64 write_blocked[LATENCY_BUCKETS];	// Sleeps of the writers waiting for room
+};
+
+#define MAILSLOT_COUNTERS ( sizeof(struct mailslot_counters) / sizeof(u64) )
+
+/* Mailslot instance struct. As in a two-lock queue, readers and writers only share the count: the
+   consumer side and the producer side live on their own cache lines, with their own lock. */
 struct mailslot {
-	wait_queue_head_t read_queue, write_queue;	// Wait queues for processes
-	struct mutex mutex;		// Mutual exclusion on mailslot (device)
-	struct message* head;	// FIFO head
-	struct message* tail;	// FIFO tail
+	int slot;				// Minor number, relative to first_minor
+	unsigned int users;		// Open files, protected by instances_lock
+	struct mutex mutex;		// Serializes the configuration changes, which also take both queue locks
 	size_t max_msg_size;
-	int msg_count;
+	size_t storage;			// Byte budget: messages are charged their footprint in the engine
+	int engine;				// MAILSLOT_ENGINE_LIST, MAILSLOT_ENGINE_RING or MAILSLOT_ENGINE_SHARED
+	char* ring;				// Ring engine: byte ring reserved when the slot is configured
+	size_t ring_size;		// Ring engine: size of the ring in bytes (power of two)
+	int spsc;				// Ring engine: single-producer/single-consumer mode, read() and write() skip the locks
+	int broadcast;			// List engine: MAILSLOT_BROADCAST_* mode
+	int overflow;			// MAILSLOT_OVERFLOW_* policy of the writers of a full mailslot
+	int sharded;			// List engine: per-CPU FIFOs instead of the lanes, read() and write() skip the queue locks
+	int created;			// Created through the control device: kept, idle or not, until destroyed there
+	struct mailslot_shard __percpu* shards;	// Sharded mode: kept once allocated, as lockless readers may look at them
+	struct shared_ring __rcu* shared;	// Shared engine: mappable ring, read locklessly by the wait conditions
+	atomic_t shared_maps;	// Shared engine: live mappings of the ring
+	struct mailslot_counters __percpu* stats;	// Performance counters
+	struct mailslot_counters stats_base;	// Sum of the counters at the last reset, protected by instances_lock
+	unsigned int depth_hwm;	// Highest depth since the last reset: rarely written, so no cache line bouncing
+	int numa_node;			// Node of the payloads set through SET_NUMA_NODE, NUMA_NO_NODE to follow the readers
+	int reader_node;		// Node of the last reader, only written when it changes
+
+	atomic_t msg_count ____cacheline_aligned_in_smp;	// List engine: queued messages
+	atomic_long_t msg_bytes;	// List engine: footprint of the queued messages
+	unsigned long lanes;	// List engine: bitmap of the lanes holding messages
+	unsigned long spsc_busy;	// SPSC mode: SPSC_* bits of the operations in progress
+
+	// Consumer side. The ring indices are only written by their own side, and published with release semantics
+	spinlock_t consumer_lock ____cacheline_aligned_in_smp;
+	struct message* head[MAILSLOT_PRIORITIES];	// List engine: dummy node of each lane, whose FIFO head is head[i]->next
+	size_t ring_head;		// Ring engine: free-running read offset
+	unsigned int ring_taken;	// Ring engine: messages dequeued so far
+	wait_queue_head_t read_queue;	// Readers waiting for messages
+
+	// Producer side
+	spinlock_t producer_lock ____cacheline_aligned_in_smp;
+	struct message* tail[MAILSLOT_PRIORITIES];	// List engine: FIFO tail of each lane (the dummy node when empty)
+	size_t ring_tail;		// Ring engine: free-running write offset
+	unsigned int ring_posted;	// Ring engine: messages enqueued so far
+	struct message** bcast;	// Broadcast mode: retained messages, by sequence number (kept once allocated)
+	u64 bcast_head;			// Broadcast mode: oldest retained sequence number
+	u64 bcast_tail;			// Broadcast mode: sequence number of the next message
+	struct list_head subscribers;	// Broadcast mode: subscribed sessions
+	unsigned int nr_subscribers;
+	wait_queue_head_t write_queue;	// Writers waiting for room
+};
+
+/* Per-open state: the modes that only apply to the I/O session of a file */
+struct session {
+	struct mailslot* ms;
+	unsigned int read_mode;	// MAILSLOT_READ_* flags
+	unsigned int busy_poll;	// Microseconds a blocking reader polls an empty mailslot before sleeping
+	unsigned int priority;	// Priority of the messages written
+	struct mutex read_mutex;	// Broadcast mode: serializes the reads of the file, which share its cursor
+	struct list_head subscriber;	// Broadcast mode: entry in the subscribers of the mailslot, empty if not subscribed
+	u64 cursor;				// Broadcast mode: sequence number of the next message to read
 };
 
 /* File operations struct */
@@ -74,44 +379,149 @@ static struct file_operations fops = {
 	.owner = THIS_MODULE,	// This field is used to prevent the module from being unloaded while its operations are in use
 	.open = mailslot_open,
 	.release = mailslot_release,
-	.read = mailslot_read,
-	.write = mailslot_write,
-	.unlocked_ioctl = mailslot_ioctl
+	.read_iter = mailslot_read_iter,
+	.write_iter = mailslot_write_iter,
+	.unlocked_ioctl = mailslot_ioctl,
+	.poll = mailslot_poll,
+	.mmap = mailslot_mmap,
+	.splice_read = mailslot_splice_read,
+	.splice_write = mailslot_splice_write,
+	.uring_cmd = mailslot_uring_cmd
+};
+
+/* Control device: creation and destruction of slots with their parameters, by the administrator */
+static const struct file_operations ctl_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = mailslot_ctl_ioctl,
+	.llseek = noop_llseek
+};
+
+static struct miscdevice ctl_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = DEVICE_NAME "-ctl",
+	.fops = &ctl_fops,
+	.mode = 0600
 };
 
+/* Pages of a spliced out message are handed over to the pipe, which releases them as any other page */
+static const struct pipe_buf_operations mailslot_pipe_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.try_steal = generic_pipe_buf_try_steal,
+	.get = generic_pipe_buf_get
+};
+
+/* Counters export, in debugfs: "stats" has a line per live slot and the totals, "latency" the histograms,
+   writing to "reset" zeroes them */
+DEFINE_SHOW_ATTRIBUTE( mailslot_stats );
+DEFINE_SHOW_ATTRIBUTE( mailslot_latency );
+
+static const struct file_operations reset_fops = {
+	.owner = THIS_MODULE,
+	.write = mailslot_stats_reset,
+	.llseek = noop_llseek
+};
+
+/* Mappings of the shared ring: while any exists the ring can be neither resized nor released */
+static const struct vm_operations_struct shared_vm_ops = {
+	.open = __shared_vma_open,
+	.close = __shared_vma_close
+};
+
+static DEFINE_STATIC_KEY_FALSE( debug_key );
+static bool debug;
+
+static int __set_debug( const char* val, const struct kernel_param* kp ) {
+
+	int error = param_set_bool( val, kp );
+
+	if ( error ) return error;
+
+	if ( debug ) static_branch_enable( &debug_key );
+	else static_branch_disable( &debug_key );
+
+	return SUCCESS;
+
+}
+
+static const struct kernel_param_ops debug_ops = {
+	.set = __set_debug,
+	.get = param_get_bool
+};
+
+module_param_cb( debug, &debug_ops, &debug, 0644 );
+MODULE_PARM_DESC( debug, "Log every mailslot operation to the kernel log (default: off)" );
+
+static unsigned int instances = INSTANCES;
+module_param( instances, uint, 0444 );
+MODULE_PARM_DESC( instances, "Number of minor numbers (mailslots) handled by the driver (default: 256)" );
+
+static unsigned int first_minor = FIRST_MINOR;
+module_param( first_minor, uint, 0444 );
+MODULE_PARM_DESC( first_minor, "First minor number of the driver (default: 0)" );
+
+static unsigned int storage = MAILSLOT_STORAGE;
+module_param( storage, uint, 0444 );
+MODULE_PARM_DESC( storage, "Default byte budget of a mailslot, messages counted by their footprint (default: 8192)" );
+
+static unsigned int default_message_size = DEFAULT_MESSAGE_SIZE;
+module_param( default_message_size, uint, 0444 );
+MODULE_PARM_DESC( default_message_size, "Maximum message size of a newly opened mailslot (default: 128)" );
+
+static unsigned int maximum_message_size = MAXIMUM_MESSAGE_SIZE;
+module_param( maximum_message_size, uint, 0444 );
+MODULE_PARM_DESC( maximum_message_size, "Upper bound of the maximum message size settable through IOCTL (default: 4 MiB)" );
+
+static int numa_node = NUMA_NO_NODE;
+module_param( numa_node, int, 0444 );
+MODULE_PARM_DESC( numa_node, "Node of the state and of the payloads of the mailslots (default: -1, the node of the first opener for the state and of the last reader for the payloads)" );
+
 static struct cdev* mailslot_cdev;
-static struct mailslot* mailslot[INSTANCES]; // Array of pointers to mailslots
+static DEFINE_XARRAY( mailslots );	// Live mailslots, indexed by slot: allocated on the first open()
+static DEFINE_MUTEX( instances_lock );	// Serializes the allocation and the release of the mailslots
+static struct mailslot_counters retired_stats;	// Counters of the released mailslots, protected by instances_lock
+static struct dentry* mailslot_debugfs;
+static struct kmem_cache* mailslot_cache;	// Cache-line aligned mailslot objects
 static dev_t dev;  // It stores the device numbers (MAJOR and MINOR)
+static struct class* mailslot_class;	// Device nodes of the slots created through the control device
 
 
 /* Function implementation */
 
 int init_module( void ) {
 
-	int i, error;
+	int error;
 
 	printk( KERN_INFO "INITIALIZING MAILSLOT DRIVER..." );
 
-	// Allocate memory for slots
-	for ( i = 0; i < INSTANCES; i++ ) {
+	if ( instances == 0 || first_minor > MINORMASK || instances > MINORMASK + 1 - first_minor ) {
+		printk( KERN_WARNING "ERROR: THE MINOR RANGE %u-%u IS NOT VALID!", first_minor, first_minor + instances - 1 );
+		return -EINVAL;
+	}
 
-		mailslot[i] = kzalloc( sizeof(struct mailslot), GFP_KERNEL );
-		
-		if ( !mailslot[i] ) {
-			printk( KERN_WARNING "ERROR: ALLOCATION FOR MAILSLOT %d FAILED!", i );
-			__deallocate_instances();
-			return -ENOMEM;
-		}
+	if ( maximum_message_size == 0 || maximum_message_size > MESSAGE_SIZE_LIMIT || default_message_size == 0 || default_message_size > maximum_message_size ) {
+		printk( KERN_WARNING "ERROR: THE MESSAGE SIZES MUST SATISFY 1 <= DEFAULT <= MAXIMUM <= %d BYTES!", MESSAGE_SIZE_LIMIT );
+		return -EINVAL;
+	}
+
+	if ( storage < LIST_FOOTPRINT( default_message_size ) || storage > STORAGE_LIMIT ) {
+		printk( KERN_WARNING "ERROR: THE STORAGE OF A MAILSLOT IS FROM %zu (ONE DEFAULT SIZE MESSAGE) TO %d BYTES!", LIST_FOOTPRINT( default_message_size ), STORAGE_LIMIT );
+		return -EINVAL;
+	}
 
-		init_waitqueue_head( &mailslot[i]->read_queue );
-		init_waitqueue_head( &mailslot[i]->write_queue );
-		mutex_init( &mailslot[i]->mutex );
-		mailslot[i]->msg_count = 0;
-		mailslot[i]->max_msg_size = DEFAULT_MESSAGE_SIZE;		
+	if ( numa_node != NUMA_NO_NODE && ( numa_node < 0 || numa_node >= nr_node_ids || !node_online( numa_node ) ) ) {
+		printk( KERN_WARNING "ERROR: NUMA NODE %d IS NOT ONLINE!", numa_node );
+		return -EINVAL;
 	}
-	
+
+	mailslot_cache = kmem_cache_create( "mailslot", sizeof(struct mailslot), 0, SLAB_HWCACHE_ALIGN, NULL );
+
+	if ( !mailslot_cache ) {
+		printk( KERN_WARNING "ERROR: CREATION OF THE MAILSLOT CACHE FAILED!" );
+		return -ENOMEM;
+	}
+
 	// Char device setup
-	error = alloc_chrdev_region( &dev, FIRST_MINOR, INSTANCES, DEVICE_NAME );	// Note: major DINAMICALLY chosen for reliability
+	error = alloc_chrdev_region( &dev, first_minor, instances, DEVICE_NAME );	// Note: major DINAMICALLY chosen for reliability
 
 	if ( error ) {
 		printk( KERN_WARNING "ERROR: ALLOCATION OF CHRDEV REGION FAILED!" );	
@@ -123,23 +533,49 @@ int init_module( void ) {
 
 	if ( mailslot_cdev == NULL ) {
 		printk( KERN_WARNING "ERROR: ALLOCATION OF THE CDEV STRUCTURE FAILED!" );
-		unregister_chrdev_region( dev, INSTANCES );
+		unregister_chrdev_region( dev, instances );
 		__deallocate_instances();
 		return -ENOMEM;
 	}
 
 	cdev_init( mailslot_cdev, &fops );	// Initializes a cdev structure, making it ready to add to the system with cdev_add
 
-	error = cdev_add( mailslot_cdev, dev, INSTANCES );	// It adds a char device to the system, making it live immediately
+	error = cdev_add( mailslot_cdev, dev, instances );	// It adds a char device to the system, making it live immediately
 	
 	if ( error ) {
 		printk( KERN_WARNING "ERROR: ADDITION OF THE CHAR DEVICE FAILED!" );
 		cdev_del( mailslot_cdev );
-		unregister_chrdev_region( dev, INSTANCES );
+		unregister_chrdev_region( dev, instances );
+		__deallocate_instances();
+		return error;
+	}
+
+	mailslot_class = class_create( DEVICE_NAME );
+
+	if ( IS_ERR( mailslot_class ) ) {
+		printk( KERN_WARNING "ERROR: CREATION OF THE DEVICE CLASS FAILED!" );
+		cdev_del( mailslot_cdev );
+		unregister_chrdev_region( dev, instances );
 		__deallocate_instances();
+		return PTR_ERR( mailslot_class );
+	}
+
+	error = misc_register( &ctl_device );
+
+	if ( error ) {
+		printk( KERN_WARNING "ERROR: REGISTRATION OF THE CONTROL DEVICE FAILED!" );
+		cdev_del( mailslot_cdev );
+		unregister_chrdev_region( dev, instances );
+		__deallocate_instances();	// The class as well
 		return error;
 	}
 
+	// Best effort, as any debugfs user: the driver works without its counters export
+	mailslot_debugfs = debugfs_create_dir( DEVICE_NAME, NULL );
+	debugfs_create_file( "stats", 0444, mailslot_debugfs, NULL, &mailslot_stats_fops );
+	debugfs_create_file( "latency", 0444, mailslot_debugfs, NULL, &mailslot_latency_fops );
+	debugfs_create_file( "reset", 0200, mailslot_debugfs, NULL, &reset_fops );
+
 	printk( KERN_INFO "INITIALIZATION OF MAILSLOT DRIVER CORRECTLY EXECUTED! MAJOR: %d\n", MAJOR(dev) );
 
 	return SUCCESS;
@@ -151,9 +587,13 @@ void cleanup_module( void ) {
 
 	printk( KERN_INFO "CLEANING UP MAILSLOT MODULE AND QUIT..." );
 
+	debugfs_remove_recursive( mailslot_debugfs );
+
+	misc_deregister( &ctl_device );	// No more slots can be created
+
 	// Delete device's structure
 	cdev_del( mailslot_cdev );
-	unregister_chrdev_region( dev, INSTANCES );
+	unregister_chrdev_region( dev, instances );
 
 	// Deallocate memory
 	__deallocate_instances();
@@ -165,9 +605,53 @@ void cleanup_module( void ) {
 
 static int mailslot_open( struct inode* inode, struct file* filp ) {
 
+	struct mailslot* ms;
+	struct session* session;
 	int slot = __get_slot( filp );
+	int error;
+
+	debug_printk( KERN_INFO "OPENING MAILSLOT..." );
+
+	session = kzalloc( sizeof(struct session), GFP_KERNEL );
+	if ( !session ) return -ENOMEM;
+
+	mutex_init( &session->read_mutex );
+	INIT_LIST_HEAD( &session->subscriber );
+
+	mutex_lock( &instances_lock );
+
+	ms = xa_load( &mailslots, slot );
+
+	if ( !ms ) {	// First open of the slot, or the slot was released while idle
+
+		ms = __mailslot_alloc( slot, numa_node );
+
+		if ( !ms ) {
+			printk( KERN_WARNING "ERROR: ALLOCATION FOR MAILSLOT %d FAILED!", slot );
+			mutex_unlock( &instances_lock );
+			kfree( session );
+			return -ENOMEM;
+		}
+
+		error = xa_err( xa_store( &mailslots, slot, ms, GFP_KERNEL ) );
+
+		if ( error ) {
+			printk( KERN_WARNING "ERROR: ALLOCATION FOR MAILSLOT %d FAILED!", slot );
+			__mailslot_free( ms );
+			mutex_unlock( &instances_lock );
+			kfree( session );
+			return error;
+		}
+	}
+
+	ms->users++;
+	session->ms = ms;
+	filp->private_data = session;
+	filp->f_mode |= FMODE_NOWAIT;	// IOCB_NOWAIT is honoured: io_uring tries inline, then waits on poll instead of a worker
 
-	printk( KERN_INFO "OPENING MAILSLOT...\nMAILSLOT SUCCESSFULLY OPENED! SLOT N°: %d", slot );
+	mutex_unlock( &instances_lock );
+
+	debug_printk( KERN_INFO "MAILSLOT SUCCESSFULLY OPENED! SLOT N°: %d", slot );
 
 	return SUCCESS;
 
@@ -176,320 +660,3968 @@ static int mailslot_open( struct inode* inode, struct file* filp ) {
 
 static int mailslot_release( struct inode* inode, struct file* filp ) {
 
-	int slot = __get_slot( filp );
+	struct mailslot* ms = __get_mailslot( filp );
+	struct mailslot_counters counters;
+	int slot = ms->slot;
 
-	printk( KERN_INFO "CLOSING MAILSLOT...\nMAILSLOT SUCCESSFULLY CLOSED! SLOT N°: %d", slot );
+	debug_printk( KERN_INFO "CLOSING MAILSLOT..." );
+
+	// Its unread broadcast messages are released
+	if ( !list_empty_careful( &__get_session( filp )->subscriber ) ) __broadcast_subscribe( ms, __get_session( filp ), 0 );
+
+	mutex_lock( &instances_lock );
+
+	// Nobody can reach the slot any more: if it holds nothing worth keeping, give the memory back
+	if ( --ms->users == 0 && __mailslot_idle( ms ) ) {
+		xa_erase( &mailslots, slot );
+		__counters_read( ms, &counters );	// Still part of the totals
+		__counters_add( &retired_stats, &counters );
+		__mailslot_free( ms );
+		debug_printk( KERN_INFO "MAILSLOT RELEASED! SLOT N°: %d", slot );
+	}
+
+	mutex_unlock( &instances_lock );
+
+	kfree( __get_session( filp ) );
+
+	debug_printk( KERN_INFO "MAILSLOT SUCCESSFULLY CLOSED! SLOT N°: %d", slot );
 
 	return SUCCESS;
 
 }
 
 
-static ssize_t mailslot_read( struct file* filp, char __user* buff, size_t len, loff_t* off ) {
+/* IOCB_NOWAIT (an inline io_uring attempt) is served as the non-blocking policy, copies included: they run with page
+   faults disabled, and a message whose copy faults is left queued. Unless the file is non-blocking itself, that is
+   only a buffer not yet resident, so the caller gets EAGAIN and retries where faults can be taken. */
+static ssize_t mailslot_read_iter( struct kiocb* iocb, struct iov_iter* to ) {
 
-	struct message* tmp;
-	char* msg_body;
-	size_t bytes_left, msg_len; 
-	int slot, non_blocking, interrupted;
+	size_t len = iov_iter_count( to );
+	int nowait = (iocb->ki_flags & IOCB_NOWAIT) && !__get_blocking_policy( iocb->ki_filp );
+	ssize_t ret = __mailslot_read( iocb, to );
 
-	slot = __get_slot( filp );
-	non_blocking = __get_blocking_policy( filp );
+	if ( ret == -EFAULT && nowait ) return -EAGAIN;
 
-	printk( KERN_INFO "MAILSLOT READING..." );
-	non_blocking ? printk( KERN_INFO "A NON-BLOCKING POLICY IS USED..." ) : printk( KERN_INFO "A BLOCKING POLICY IS USED..." );
+	if ( ret < 0 ) {
+		trace_mailslot_error( __get_mailslot( iocb->ki_filp )->slot, MAILSLOT_TRACE_READ, len, ret );
+		__account_error( __get_mailslot( iocb->ki_filp ), ret );
+	}
+
+	return ret;
+
+}
+
+
+static ssize_t __mailslot_read( struct kiocb* iocb, struct iov_iter* to ) {
+
+	struct mailslot* ms;
+	struct message* msg;
+	ssize_t msg_len;
+	size_t len, bytes_left, fault_len;
+	unsigned int mode, busy_poll;
+	u64 stamp;
+	int non_blocking, error;
+
+	ms = __get_mailslot( iocb->ki_filp );
+	non_blocking = __get_blocking_policy( iocb->ki_filp ) || (iocb->ki_flags & IOCB_NOWAIT);
+	mode = READ_ONCE( __get_session( iocb->ki_filp )->read_mode );
+	busy_poll = READ_ONCE( __get_session( iocb->ki_filp )->busy_poll );
+	len = iov_iter_count( to );
+
+	debug_printk( KERN_INFO "MAILSLOT READING..." );
+	non_blocking ? debug_printk( KERN_INFO "A NON-BLOCKING POLICY IS USED..." ) : debug_printk( KERN_INFO "A BLOCKING POLICY IS USED..." );
 	
 	if ( len == 0 ) {
-		printk( KERN_WARNING "ERROR: REQUESTED TO READ 0 BYTE!" ); 
+		debug_printk( KERN_WARNING "ERROR: REQUESTED TO READ 0 BYTE!" ); 
 		return -EINVAL;
 	}
-	
-	if ( buff == NULL ) {
-		printk( KERN_WARNING "ERROR: READ FUNCTION CALLED WITH NULL BUFFER PARAMETER!" ); 
-		return -EINVAL;	
-	}	
-	
-	if ( non_blocking ) {
 
-		if ( __mailslot_lock( slot, NONBLOCKING ) == -EAGAIN ) return -EAGAIN;
+retry:
+	if ( READ_ONCE( ms->broadcast ) ) {
+		msg_len = __broadcast_read( ms, __get_session( iocb->ki_filp ), to, mode, non_blocking );
+		if ( msg_len != -EOPNOTSUPP ) return msg_len;
+	}
 
-		if ( mailslot[slot]->msg_count == 0 ) {
-			printk( KERN_INFO "THE MAILSLOT IS EMPTY. SLOT N°: %d", slot );
-			__mailslot_unlock( slot );
-			return -EAGAIN;
-		}
-	}		
-	else { // The default behaviour is a blocking policy
+	if ( mode & MAILSLOT_READ_DRAIN ) return __mailslot_drain( ms, to, non_blocking, busy_poll );
 
-		if ( __mailslot_lock( slot, BLOCKING ) == -EINTR ) return -EINTR;
-		
-		while ( mailslot[slot]->msg_count == 0 ) {
-			__mailslot_unlock( slot );
-			interrupted = wait_event_interruptible_exclusive( mailslot[slot]->read_queue, mailslot[slot]->msg_count > 0 );
-			if ( interrupted ) return -EINTR;	 
-			if ( __mailslot_lock( slot, BLOCKING ) == -EINTR ) return -EINTR;		
-		} 				
+	if ( READ_ONCE( ms->spsc ) || READ_ONCE( ms->sharded ) ) {
+		msg_len = __lockless_read( ms, to, mode, non_blocking, !non_blocking, busy_poll );
+		if ( msg_len != -EOPNOTSUPP ) return msg_len;
 	}
 
-	msg_body = mailslot[slot]->head->content;
-	msg_len = mailslot[slot]->head->length;
+	error = __wait_readable( ms, non_blocking, busy_poll );	// On success the consumer lock is held
+	if ( error ) return error;
 
-	if ( msg_len > len ) {
-		printk( KERN_WARNING "ERROR: CAN'T READ. BUFFER TOO LITTLE!" );
-		__mailslot_unlock( slot );
-		return -EMSGSIZE;
+	if ( ms->spsc || ms->sharded || ms->broadcast ) {	// Switched to another mode meanwhile
+		__consumer_unlock( ms );
+		goto retry;
 	}
 
-	if ( non_blocking ) {
-		pagefault_disable();
-		bytes_left = copy_to_user( buff, msg_body, msg_len );
-		pagefault_enable();
+	if ( ms->engine != MAILSLOT_ENGINE_LIST ) {
+
+		// A ring record can only be released after the copy, which is done with page faults disabled
+		msg_len = __inplace_dequeue( ms, to, mode, &stamp );
+
+		if ( msg_len == -EFAULT && !non_blocking ) {
+			fault_len = min( len, ms->max_msg_size );
+			__consumer_unlock( ms );
+			if ( fault_in_iov_iter_writeable( to, fault_len ) ) return -EFAULT;
+			goto retry;
+		}
+
+		if ( msg_len == -EAGAIN && !non_blocking ) {	// A userspace consumer of the shared ring came first
+			__consumer_unlock( ms );
+			error = __shared_backoff();
+			if ( error ) return error;
+			goto retry;
+		}
+
+		if ( msg_len < 0 ) {
+			__consumer_unlock( ms );
+			return msg_len;
+		}
+
+		__account_dequeue( ms, msg_len, stamp );
+		msg = NULL;
 	}
-	else bytes_left = copy_to_user( buff, msg_body, msg_len );
+	else {
 
-	if ( bytes_left > 0 ) {
-		printk( KERN_WARNING "ERROR: CAN'T GET THE MESSAGE FROM MAILSLOT! SLOT N°: %d", slot );
-		__mailslot_unlock( slot );
-		return -EFAULT;
+		if ( __list_peek( ms )->length > len && !(mode & MAILSLOT_READ_TRUNC) ) {
+			debug_printk( KERN_WARNING "ERROR: CAN'T READ. BUFFER TOO LITTLE!" );
+			__consumer_unlock( ms );
+			return -EMSGSIZE;
+		}
+
+		msg = __list_unlink( ms, __list_lane( ms ) );	// Counted once delivered, by __list_release()
+		msg_len = msg->length;
 	}
 
-	printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", msg_len );
-	printk( KERN_INFO "MESSAGE CONTENT: %s", msg_body );
+	if ( __mailslot_depth( ms ) )
+		debug_printk( KERN_INFO "THERE ARE %d MORE MESSAGES IN THE MAILSLOT. SLOT N°: %d", __mailslot_depth( ms ), ms->slot );
+
+	__consumer_unlock( ms );
 
-	tmp = mailslot[slot]->head;
+	if ( msg ) {
 
-	if ( mailslot[slot]->msg_count > 1 )
-		mailslot[slot]->head = mailslot[slot]->head->next;
+		// The message is already unlinked: a faulting copy no longer stalls the other users of the slot
+		if ( non_blocking ) {
+			pagefault_disable();
+			bytes_left = __message_copy_out( msg, to, mode );
+			pagefault_enable();
+		}
+		else bytes_left = __message_copy_out( msg, to, mode );
+
+		if ( bytes_left > 0 ) {
+			debug_printk( KERN_WARNING "ERROR: CAN'T GET THE MESSAGE FROM MAILSLOT! SLOT N°: %d", ms->slot );
+			__list_push_front( ms, msg );	// Not delivered: give it back to the slot
+			return -EFAULT;
+		}
 
-	kfree( tmp->content );
-	kfree( tmp );
+		__list_release( ms, msg );
 
-	if ( --(mailslot[slot]->msg_count) )
-		printk( KERN_INFO "THERE ARE %d MORE MESSAGES IN THE MAILSLOT. SLOT N°: %d", mailslot[slot]->msg_count, slot );
+		debug_printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", (size_t) msg_len );
+		debug_printk( KERN_INFO "MESSAGE CONTENT: %.*s", (int) msg_len, msg->content );	// Not NUL-terminated
 
-	__mailslot_unlock( slot );
+		__message_free( msg );
+	}
 
-	wake_up_interruptible( &mailslot[slot]->write_queue );
+	__wake_writers( ms, 1 );
 
 	return msg_len;
 
 }
 
 
-static ssize_t mailslot_write( struct file* filp, const char __user* buff, size_t len, loff_t* off ) {
+/* Drain mode read: as many whole messages as fit the buffer, each preceded by its length as a u32, taken
+   with a single hold of the consumer lock. Fails only if not even the first message can be delivered. */
+static ssize_t __mailslot_drain( struct mailslot* ms, struct iov_iter* to, int non_blocking, unsigned int busy_poll ) {
 
-	struct message* new_msg;
-	size_t bytes_left; 
-	int slot, non_blocking, interrupted;
+	struct message *chain, **chain_tail, *msg;
+	ssize_t msg_len, done;
+	size_t room, bytes_left, fault_len;
+	unsigned int taken;
+	u64 stamp;
+	int error;
 
-	slot = __get_slot( filp );
-	non_blocking = __get_blocking_policy( filp );
-	
-	printk( KERN_INFO "MAILSLOT WRITING..." );
-	non_blocking ? printk( KERN_INFO "A NON-BLOCKING POLICY IS USED..." ) : printk( KERN_INFO "A BLOCKING POLICY IS USED..." );
-	
-	if ( len == 0 ) {
-		printk( KERN_WARNING "ERROR: REQUESTED TO WRITE A 0 BYTE MESSAGE!" ); 
-		return -EINVAL;
-	}
-	
-	if ( buff == NULL ) {
-		printk( KERN_WARNING "ERROR: WRITE FUNCTION CALLED WITH NULL BUFFER PARAMETER!" ); 
-		return -EINVAL;	
-	}	
-		
-	if ( non_blocking ) {
+retry:
+	// SPSC and sharded modes: one lockless dequeue per message, only the first one may wait for a message
+	if ( READ_ONCE( ms->spsc ) || READ_ONCE( ms->sharded ) ) {
 
-		if ( __mailslot_lock( slot, NONBLOCKING ) == -EAGAIN ) return -EAGAIN;
+		done = 0;
+		do {
+			msg_len = __lockless_read( ms, to, MAILSLOT_READ_DRAIN, non_blocking, !non_blocking && done == 0, busy_poll );
+			if ( msg_len >= 0 ) done += FRAME_HEADER + msg_len;
+		} while ( msg_len >= 0 );
 
-		if ( mailslot[slot]->msg_count == MAILSLOT_STORAGE ) {
-			printk( KERN_WARNING "ERROR: CAN'T WRITE. THE MAILSLOT IS FULL! SLOT N°: %d", slot );
-			__mailslot_unlock( slot );
-			return -EAGAIN;
-		}
+		if ( done > 0 ) return done;
+		if ( msg_len != -EOPNOTSUPP ) return msg_len;
 	}
-	else { // The default behaviour is a blocking policy
 
-		if ( __mailslot_lock( slot, BLOCKING ) == -EINTR ) return -EINTR;
-		
-		while ( mailslot[slot]->msg_count == MAILSLOT_STORAGE ) {
-			__mailslot_unlock( slot );
-			interrupted = wait_event_interruptible_exclusive( mailslot[slot]->write_queue, mailslot[slot]->msg_count < MAILSLOT_STORAGE );
-			if ( interrupted ) return -EINTR;			 
-			if ( __mailslot_lock( slot, BLOCKING ) == -EINTR ) return -EINTR;		
-		} 				
-	}
+	error = __wait_readable( ms, non_blocking, busy_poll );	// On success the consumer lock is held
+	if ( error ) return error;
 
-	if ( len > mailslot[slot]->max_msg_size ) {
-		printk( KERN_WARNING "ERROR: CAN'T WRITE. MESSAGE TOO BIG! MAXIMUM NUMBER OF CHARACTERS IS %zu!", mailslot[slot]->max_msg_size ); // - 1 because of null-byte terminator
-		__mailslot_unlock( slot );
-		return -EPERM;
+	if ( ms->spsc || ms->sharded ) {	// Switched to a lockless mode meanwhile
+		__consumer_unlock( ms );
+		goto retry;
 	}
 
-	new_msg = kzalloc( sizeof(struct message), non_blocking ? GFP_ATOMIC : GFP_KERNEL );
-	if ( !new_msg ) {
-		printk( KERN_WARNING "ERROR: FAILED TO ALLOCATE MEMORY FOR THE MESSAGE STRUCT" );
-		__mailslot_unlock( slot );
-		return non_blocking ? -EAGAIN : -ENOMEM;
+	if ( ms->broadcast ) {	// Switched to the broadcast mode meanwhile, which can't be drained
+		__consumer_unlock( ms );
+		return -EINVAL;
 	}
 
-	new_msg->length = len;
-	new_msg->content = kzalloc( len, non_blocking ? GFP_ATOMIC : GFP_KERNEL );
-	if ( !new_msg->content ) {
-		printk( KERN_WARNING "ERROR: FAILED TO ALLOCATE MEMORY FOR THE MESSAGE CONTENT" );
-		kfree( new_msg );
-		__mailslot_unlock( slot );
-		return non_blocking ? -EAGAIN : -ENOMEM;
+	done = 0;
+	msg_len = -EAGAIN;
+	room = iov_iter_count( to );
+	chain = NULL;
+	chain_tail = &chain;
+
+	for ( taken = 0; !__mailslot_empty( ms ); taken++ ) {
+
+		if ( ms->engine != MAILSLOT_ENGINE_LIST ) {
+			msg_len = __inplace_dequeue( ms, to, MAILSLOT_READ_DRAIN, &stamp );
+			if ( msg_len < 0 ) break;
+			done += FRAME_HEADER + msg_len;
+			__account_dequeue( ms, msg_len, stamp );
+		}
+		else {
+			if ( FRAME_HEADER + __list_peek( ms )->length > room ) {
+				msg_len = -EMSGSIZE;
+				break;
+			}
+			msg = __list_unlink( ms, __list_lane( ms ) );	// Counted once delivered, by __list_release()
+			*chain_tail = msg;
+			chain_tail = &msg->next;
+			msg_len = msg->length;
+			room -= FRAME_HEADER + msg_len;
+		}
 	}
-	
-	if ( non_blocking ) {
-		pagefault_disable();
-		bytes_left = copy_from_user( new_msg->content, buff, len );
-		pagefault_enable();
+
+	debug_printk( KERN_INFO "%u MESSAGES DRAINED FROM MAILSLOT! SLOT N°: %d", taken, ms->slot );
+
+	if ( taken == 0 && msg_len == -EFAULT && !non_blocking ) {
+		fault_len = min( iov_iter_count( to ), FRAME_HEADER + ms->max_msg_size );
+		__consumer_unlock( ms );
+		if ( fault_in_iov_iter_writeable( to, fault_len ) ) return -EFAULT;
+		goto retry;
 	}
-	else bytes_left = copy_from_user( new_msg->content, buff, len );
 
-	if ( bytes_left > 0 ) {
-		printk( KERN_WARNING "ERROR: CAN'T DELIVER THE MESSAGE TO MAILSLOT! SLOT N°: %d", slot );
-		kfree( new_msg->content );
-		kfree( new_msg );
-		__mailslot_unlock( slot );
-		return -EFAULT;
+	__consumer_unlock( ms );
+
+	if ( taken == 0 ) {
+		if ( msg_len == -EAGAIN && !non_blocking ) {	// A userspace consumer of the shared ring came first
+			error = __shared_backoff();
+			if ( error ) return error;
+			goto retry;
+		}
+		if ( msg_len == -EMSGSIZE ) debug_printk( KERN_WARNING "ERROR: CAN'T READ. BUFFER TOO LITTLE!" );
+		return msg_len;
 	}
-	
-	printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", new_msg->length );
-	printk( KERN_INFO "MESSAGE CONTENT: %s", new_msg->content );
 
-	if ( mailslot[slot]->msg_count == 0 ) 
-		mailslot[slot]->head = new_msg;
-	else
-		mailslot[slot]->tail->next = new_msg;
+	// List engine messages are copied out after the unlock, as in read()
+	while ( chain ) {
 
-	mailslot[slot]->tail = new_msg;
-	
-	mailslot[slot]->msg_count++;
+		msg = chain;
 
-	printk( KERN_INFO "MESSAGE CORRECTLY DELIVERED TO MAILSLOT! SLOT N°: %d", slot );
-	printk( KERN_INFO "THE MAILSLOT HAS %d NEW MESSAGES NOW! SLOT N°: %d", mailslot[slot]->msg_count, slot );
+		if ( non_blocking ) {
+			pagefault_disable();
+			bytes_left = __message_copy_out( msg, to, MAILSLOT_READ_DRAIN );
+			pagefault_enable();
+		}
+		else bytes_left = __message_copy_out( msg, to, MAILSLOT_READ_DRAIN );
 
-	__mailslot_unlock( slot );
+		if ( bytes_left > 0 ) {
+			debug_printk( KERN_WARNING "ERROR: CAN'T GET THE MESSAGE FROM MAILSLOT! SLOT N°: %d", ms->slot );
+			__list_push_front( ms, chain );	// Not delivered: give them back to the slot, in order
+			break;
+		}
 
-	wake_up_interruptible( &mailslot[slot]->read_queue );
+		__list_release( ms, msg );
+		done += FRAME_HEADER + msg->length;
+		chain = msg->next;
+		__message_free( msg );
+	}
 
-	return len;
+	__wake_writers( ms, taken );
+
+	return done > 0 ? done : -EFAULT;
 
 }
 
 
-static long mailslot_ioctl( struct file* filp, unsigned int cmd, unsigned long arg ) {
-	
-	int slot, non_blocking, error;
-	
-	slot = __get_slot( filp );
-	non_blocking = __get_blocking_policy( filp );
+/* As mailslot_read_iter(): a faulting copy of an IOCB_NOWAIT write has posted nothing, and is retried */
+static ssize_t mailslot_write_iter( struct kiocb* iocb, struct iov_iter* from ) {
 
-	switch ( cmd ) {
+	size_t len = iov_iter_count( from );
+	int nowait = (iocb->ki_flags & IOCB_NOWAIT) && !__get_blocking_policy( iocb->ki_filp );
+	ssize_t ret = __mailslot_write( iocb, from );
 
-		case SET_BLOCKING:
-			printk( KERN_INFO "SET BLOCKING POLICY! SLOT N°: %d", slot );	
-			filp->f_flags &= ~O_NONBLOCK;	// AND bit a bit because O_NONBLOCK is a bit mask
-			break;
+	if ( ret == -EFAULT && nowait ) return -EAGAIN;
 
-		case SET_NONBLOCKING:
-			printk( KERN_INFO "SET NON-BLOCKING POLICY! SLOT N°: %d", slot );
-			filp->f_flags |= O_NONBLOCK;	// OR bit a bit because O_NONBLOCK is a bit mask
-			break;
+	if ( ret < 0 ) {
+		trace_mailslot_error( __get_mailslot( iocb->ki_filp )->slot, MAILSLOT_TRACE_WRITE, len, ret );
+		__account_error( __get_mailslot( iocb->ki_filp ), ret );
+	}
 
-		case SET_MAXIMUM_MSG_SIZE:
-			printk( KERN_INFO "SETTING NEW MAXIMUM MESSAGE SIZE (%d)...", (int) arg );
-			if ( arg == 0 || arg > MAXIMUM_MESSAGE_SIZE ) {
-				printk( KERN_WARNING "ERROR: THE MAXIMUM SETTABLE MESSAGE SIZE IS FROM 1 TO %d BYTES!", (int) MAXIMUM_MESSAGE_SIZE );
-				return -EINVAL;
-			}
-			
-			error = __mailslot_lock( slot, non_blocking );
-			
-			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
-			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
-			
-			mailslot[slot]->max_msg_size = arg;
-			printk( KERN_INFO "MAXIMUM MESSAGE SIZE SETTED TO %zu BYTES! SLOT N°: %d", mailslot[slot]->max_msg_size, slot );
-			__mailslot_unlock( slot );
-			break;
+	return ret;
 
-		default:
-			printk( KERN_WARNING "ERROR: IOCTL COMMAND NOT IDENTIFIED! CODE: %u", cmd );
-			return -ENOTTY;
-			
-	}
-	
-	return SUCCESS;
-	
 }
 
 
-static void __deallocate_instances( void ) {
+/* Move the next message to a pipe. The list engine pages of the message are handed over to the pipe as
+   they are, without a copy; smaller messages take a page of their own. Atomic as read(): the pipe must have
+   room for the whole message, otherwise -EAGAIN (or -EMSGSIZE, if it never can). Called with the pipe locked. */
+static ssize_t mailslot_splice_read( struct file* in, loff_t* ppos, struct pipe_inode_info* pipe, size_t len, unsigned int flags ) {
+
+	struct mailslot* ms;
+	struct message* msg;
+	struct page* spare;
+	struct pipe_buffer buf;
+	unsigned int i, slots;
+	size_t msg_len;
+	int non_blocking, error;
+
+	ms = __get_mailslot( in );
+	non_blocking = __get_blocking_policy( in ) || (flags & SPLICE_F_NONBLOCK);
 
-	struct message* tmp;
-	int i, j;
+	if ( READ_ONCE( ms->engine ) != MAILSLOT_ENGINE_LIST || READ_ONCE( ms->broadcast ) || READ_ONCE( ms->sharded ) ) {
+		debug_printk( KERN_WARNING "ERROR: SPLICE NEEDS THE LIST ENGINE, OUTSIDE OF THE BROADCAST AND SHARDED MODES! SLOT N°: %d", ms->slot );
+		return -EINVAL;
+	}
 
-	for ( i = 0; i < INSTANCES; i++ ) {
+	spare = alloc_page( GFP_KERNEL );	// For a message that is not paged: allocated before taking the lock
+	if ( !spare ) return -ENOMEM;
 
-		if ( mailslot[i] == NULL ) return;
+	error = __wait_readable( ms, non_blocking, READ_ONCE( __get_session( in )->busy_poll ) );	// On success the consumer lock is held
+	if ( error ) goto out;
 
-		for ( j = 0; j < mailslot[i]->msg_count; j++ ) {
-		
-			tmp = mailslot[i]->head->next;
-			kfree( mailslot[i]->head->content );
-			kfree( mailslot[i]->head );
-			mailslot[i]->head = tmp;
-			
-		}
+	msg = ms->engine == MAILSLOT_ENGINE_LIST && !ms->broadcast && !ms->sharded ? __list_peek( ms ) : NULL;
+	slots = msg && msg->pages ? msg->nr_pages : 1;
 
-		kfree( mailslot[i] );
+	if ( !msg ) error = -EINVAL;	// The engine or the mode changed meanwhile
+	else if ( !pipe->readers ) error = -EPIPE;
+	else if ( msg->length > len || slots > pipe->max_usage ) error = -EMSGSIZE;
+	else if ( slots > pipe->max_usage - pipe_occupancy( pipe->head, pipe->tail ) ) error = -EAGAIN;
 
-	}	
+	if ( error ) {
+		__consumer_unlock( ms );
+		goto out;
+	}
 
-}
+	msg = __list_unlink( ms, __list_lane( ms ) );
+	msg_len = msg->length;
+	__list_release( ms, msg );	// Nothing can fail from here on
 
+	__consumer_unlock( ms );
 
-static int __get_slot( struct file* filp ) {
+	__wake_writers( ms, 1 );
 
-	return iminor( filp->f_path.dentry->d_inode ) - FIRST_MINOR;
+	if ( !msg->pages ) {
+		memcpy( page_address( spare ), msg->content, msg_len );
+		buf = (struct pipe_buffer) { .page = spare, .len = msg_len, .ops = &mailslot_pipe_buf_ops };
+		spare = NULL;
+		add_to_pipe( pipe, &buf );
+	}
+	else for ( i = 0; i < msg->nr_pages; i++ ) {
+		buf = (struct pipe_buffer) { .page = msg->pages[i], .len = min_t( size_t, msg_len - i * PAGE_SIZE, PAGE_SIZE ), .ops = &mailslot_pipe_buf_ops };
+		msg->pages[i] = NULL;	// Owned by the pipe now
+		add_to_pipe( pipe, &buf );
+	}
 
-}
+	debug_printk( KERN_INFO "MESSAGE SPLICED TO A PIPE! SLOT N°: %d", ms->slot );
 
+	__message_free( msg );
+	error = msg_len;
 
-static int __get_blocking_policy( struct file* filp ) {
+out:
+	if ( spare ) put_page( spare );
+
+	return error;
 
-	return filp->f_flags & O_NONBLOCK ? NONBLOCKING : BLOCKING;
-	
 }
 
 
-static int __mailslot_lock( int slot, int non_blocking ) {
-	
-	if ( non_blocking ) {
-		if ( mutex_trylock( &mailslot[slot]->mutex ) == 0 ) { 
-			printk( KERN_WARNING "ERROR: FAILED TO ACQUIRE THE LOCK - NONBLOCKING POLICY" );
-			return -EAGAIN;
-		}				
-	}
-	
-	else { // The default behaviour is a blocking policy
-		if ( mutex_lock_interruptible( &mailslot[slot]->mutex ) == -EINTR ) {
-			printk( KERN_WARNING "ERROR: FAILED TO ACQUIRE THE LOCK - BLOCKING POLICY" );
-			return -EINTR;
-		}	
-	}
-	
-	return SUCCESS;
-	
-}
+/* Post the data available in a pipe, up to the maximum message size, as a single message. The room for
+   the largest possible message is reserved first, so that nothing is taken from the pipe that could then
+   not be posted; the reservation also keeps the storage engine from changing meanwhile. */
+static ssize_t mailslot_splice_write( struct pipe_inode_info* pipe, struct file* out, loff_t* ppos, size_t len, unsigned int flags ) {
 
+	struct mailslot* ms;
+	struct message* msg;
+	struct splice_desc sd;
+	size_t total;
+	ssize_t ret;
+	int non_blocking;
 
-static void __mailslot_unlock( int slot ) {
+	ms = __get_mailslot( out );
+	non_blocking = __get_blocking_policy( out ) || (flags & SPLICE_F_NONBLOCK);
 
-	mutex_unlock( &mailslot[slot]->mutex );
+	if ( READ_ONCE( ms->engine ) != MAILSLOT_ENGINE_LIST || READ_ONCE( ms->broadcast ) || READ_ONCE( ms->sharded ) ) {
+		debug_printk( KERN_WARNING "ERROR: SPLICE NEEDS THE LIST ENGINE, OUTSIDE OF THE BROADCAST AND SHARDED MODES! SLOT N°: %d", ms->slot );
+		return -EINVAL;
+	}
 
-}
+	total = min_t( size_t, len, READ_ONCE( ms->max_msg_size ) );
+	if ( total == 0 ) return 0;
 
+	msg = __message_alloc( total, 1, non_blocking, __message_node( ms ) );
+	if ( !msg ) return non_blocking ? -EAGAIN : -ENOMEM;
+
+	ret = __wait_writable( ms, total, non_blocking );	// On success the producer lock is held
+	if ( ret ) {
+		__message_free( msg );
+		return ret;
+	}
+
+	if ( ms->engine != MAILSLOT_ENGINE_LIST || ms->broadcast || ms->sharded ) {
+		__producer_unlock( ms );
+		__message_free( msg );
+		return -EINVAL;
+	}
+
+	atomic_long_add( LIST_FOOTPRINT( total ), &ms->msg_bytes );	// Reserved
+	__producer_unlock( ms );
+
+	sd = (struct splice_desc) { .total_len = total, .flags = flags, .pos = *ppos, .u.data = msg };
+
+	pipe_lock( pipe );
+	ret = __splice_from_pipe( pipe, &sd, __splice_actor );
+	pipe_unlock( pipe );
+
+	if ( ret > 0 ) {
+		__message_trim( msg );
+		msg->stamp = __enqueue_stamp();
+		msg->priority = READ_ONCE( __get_session( out )->priority );
+		__producer_lock( ms );
+		__list_link( ms, msg );
+		__account_enqueue( ms, msg->length );
+		trace_mailslot_enqueue( ms->slot, msg->length, __mailslot_depth( ms ) );
+		__producer_unlock( ms );
+		__wake_readers( ms, 1 );
+	}
+	else __message_free( msg );
+
+	atomic_long_sub( LIST_FOOTPRINT( total ), &ms->msg_bytes );	// The message, if any, is charged its own footprint now
+
+	if ( ret < (ssize_t) total ) __wake_writers( ms, 1 );	// Room of the reservation left unused
+
+	return ret;
+
+}
+
+
+/* Copy a pipe buffer at the end of the message being spliced in: sd->len bytes, never beyond total_len */
+static int __splice_actor( struct pipe_inode_info* pipe, struct pipe_buffer* buf, struct splice_desc* sd ) {
+
+	struct message* msg = sd->u.data;
+	size_t done, chunk;
+	char *src, *dst;
+
+	src = kmap_local_page( buf->page );
+
+	for ( done = 0; done < sd->len; done += chunk ) {
+		chunk = min_t( size_t, sd->len - done, PAGE_SIZE - offset_in_page( msg->length ) );
+		dst = kmap_local_page( msg->pages[msg->length >> PAGE_SHIFT] );
+		memcpy( dst + offset_in_page( msg->length ), src + buf->offset + done, chunk );
+		kunmap_local( dst );
+		msg->length += chunk;
+	}
+
+	kunmap_local( src );
+
+	return sd->len;
+
+}
+
+
+/* A write() is a single message, a writev() too: the iovecs are gathered in order into one atomic message */
+static ssize_t __mailslot_write( struct kiocb* iocb, struct iov_iter* from ) {
+
+	struct mailslot* ms;
+	struct message* new_msg;
+	size_t len;
+	ssize_t ret;
+	int non_blocking, engine, error;
+
+	ms = __get_mailslot( iocb->ki_filp );
+	non_blocking = __get_blocking_policy( iocb->ki_filp ) || (iocb->ki_flags & IOCB_NOWAIT);
+	len = iov_iter_count( from );
+	
+	debug_printk( KERN_INFO "MAILSLOT WRITING..." );
+	non_blocking ? debug_printk( KERN_INFO "A NON-BLOCKING POLICY IS USED..." ) : debug_printk( KERN_INFO "A BLOCKING POLICY IS USED..." );
+	
+	if ( len == 0 ) {
+		debug_printk( KERN_WARNING "ERROR: REQUESTED TO WRITE A 0 BYTE MESSAGE!" ); 
+		return -EINVAL;
+	}
+	
+	// Early check without the lock, so that an oversized message is not even built (repeated under the lock)
+	if ( len > READ_ONCE( ms->max_msg_size ) ) {
+		debug_printk( KERN_WARNING "ERROR: CAN'T WRITE. MESSAGE TOO BIG! MAXIMUM NUMBER OF CHARACTERS IS %zu!", READ_ONCE( ms->max_msg_size ) );
+		return -EPERM;
+	}
+
+retry:
+	if ( READ_ONCE( ms->broadcast ) ) {
+		ret = __broadcast_write( ms, from, non_blocking );
+		if ( ret != -EOPNOTSUPP ) return ret;
+	}
+
+	if ( READ_ONCE( ms->spsc ) || READ_ONCE( ms->sharded ) ) {
+		ret = __lockless_write( ms, from, non_blocking, !non_blocking );
+		if ( ret != -EOPNOTSUPP ) return ret;
+	}
+
+	engine = READ_ONCE( ms->engine );
+
+	// The list engine message is allocated and filled before taking the lock
+	new_msg = NULL;
+	if ( engine == MAILSLOT_ENGINE_LIST ) {
+		new_msg = __message_build( ms, from, READ_ONCE( __get_session( iocb->ki_filp )->priority ), non_blocking );
+		if ( IS_ERR( new_msg ) ) return PTR_ERR( new_msg );
+	}
+
+	error = __wait_writable( ms, len, non_blocking );	// On success the producer lock is held
+	if ( error ) {
+		if ( new_msg ) __message_free( new_msg );
+		return error;
+	}
+
+	if ( ms->engine != engine || ms->spsc || ms->sharded || ms->broadcast ) {	// The (empty) slot switched engine or mode meanwhile
+		__producer_unlock( ms );
+		if ( new_msg ) {
+			__message_free( new_msg );
+			iov_iter_revert( from, len );	// Consumed by the copy into the message
+		}
+		goto retry;
+	}
+
+	if ( engine != MAILSLOT_ENGINE_LIST ) {
+
+		// The ring is written in place under the lock, with page faults disabled
+		error = __inplace_enqueue( ms, from );
+
+		if ( error == -EFAULT && !non_blocking ) {
+			__producer_unlock( ms );
+			if ( fault_in_iov_iter_readable( from, len ) ) return -EFAULT;
+			goto retry;
+		}
+
+		if ( error == -EAGAIN && !non_blocking ) {	// A userspace producer of the shared ring took the room
+			__producer_unlock( ms );
+			error = __shared_backoff();
+			if ( error ) return error;
+			goto retry;
+		}
+
+		if ( error ) {
+			__producer_unlock( ms );
+			return error;
+		}
+	}
+	else __list_link( ms, new_msg );
+	
+	__account_enqueue( ms, len );
+	trace_mailslot_enqueue( ms->slot, len, __mailslot_depth( ms ) );
+
+	debug_printk( KERN_INFO "MESSAGE CORRECTLY DELIVERED TO MAILSLOT! SLOT N°: %d", ms->slot );
+	debug_printk( KERN_INFO "THE MAILSLOT HAS %d NEW MESSAGES NOW! SLOT N°: %d", __mailslot_depth( ms ), ms->slot );
+
+	__producer_unlock( ms );
+
+	__wake_readers( ms, 1 );
+
+	return len;
+
+}
+
+
+static long mailslot_ioctl( struct file* filp, unsigned int cmd, unsigned long arg ) {
+	
+	struct mailslot* ms;
+	struct shared_ring* ring;
+	struct mailslot_info info;
+	struct mailslot_batch batch;
+	int non_blocking, error;
+	
+	ms = __get_mailslot( filp );
+	non_blocking = __get_blocking_policy( filp );
+
+	switch ( cmd ) {
+
+		case SET_BLOCKING:
+			debug_printk( KERN_INFO "SET BLOCKING POLICY! SLOT N°: %d", ms->slot );	
+			filp->f_flags &= ~O_NONBLOCK;	// AND bit a bit because O_NONBLOCK is a bit mask
+			break;
+
+		case SET_NONBLOCKING:
+			debug_printk( KERN_INFO "SET NON-BLOCKING POLICY! SLOT N°: %d", ms->slot );
+			filp->f_flags |= O_NONBLOCK;	// OR bit a bit because O_NONBLOCK is a bit mask
+			break;
+
+		case SET_READ_MODE:
+			debug_printk( KERN_INFO "SETTING READ MODE (%d)...", (int) arg );
+			if ( arg & ~(MAILSLOT_READ_DRAIN | MAILSLOT_READ_TRUNC) ) {
+				debug_printk( KERN_WARNING "ERROR: UNKNOWN READ MODE FLAGS!" );
+				return -EINVAL;
+			}
+			if ( (arg & MAILSLOT_READ_DRAIN) && (arg & MAILSLOT_READ_TRUNC) ) {
+				debug_printk( KERN_WARNING "ERROR: THE DRAIN MODE CAN'T TRUNCATE MESSAGES!" );
+				return -EINVAL;
+			}
+			WRITE_ONCE( __get_session( filp )->read_mode, arg );
+			break;
+
+		case SET_BUSY_POLL:
+			debug_printk( KERN_INFO "SETTING BUSY POLLING BUDGET (%lu)...", arg );
+			if ( arg > BUSY_POLL_LIMIT ) {
+				debug_printk( KERN_WARNING "ERROR: THE BUSY POLLING BUDGET IS FROM 0 TO %d MICROSECONDS!", BUSY_POLL_LIMIT );
+				return -EINVAL;
+			}
+			WRITE_ONCE( __get_session( filp )->busy_poll, arg );
+			break;
+
+		case SET_WRITE_PRIORITY:
+			debug_printk( KERN_INFO "SETTING WRITE PRIORITY (%lu)...", arg );
+			if ( arg >= MAILSLOT_PRIORITIES ) {
+				debug_printk( KERN_WARNING "ERROR: THE PRIORITY IS FROM 0 TO %d!", MAILSLOT_PRIORITIES - 1 );
+				return -EINVAL;
+			}
+			WRITE_ONCE( __get_session( filp )->priority, arg );
+			break;
+
+		case SET_NUMA_NODE:
+			debug_printk( KERN_INFO "SETTING NUMA NODE (%d)...", (int) arg );
+			if ( (int) arg != MAILSLOT_NUMA_AUTO && ( (int) arg < 0 || (int) arg >= nr_node_ids || !node_online( (int) arg ) ) ) {
+				debug_printk( KERN_WARNING "ERROR: NUMA NODE %d IS NOT ONLINE!", (int) arg );
+				return -EINVAL;
+			}
+			WRITE_ONCE( ms->numa_node, (int) arg == MAILSLOT_NUMA_AUTO ? NUMA_NO_NODE : (int) arg );	// A hint: no lock needed
+			break;
+
+		case SET_MAXIMUM_MSG_SIZE:
+			debug_printk( KERN_INFO "SETTING NEW MAXIMUM MESSAGE SIZE (%d)...", (int) arg );
+			if ( arg == 0 || arg > maximum_message_size ) {
+				debug_printk( KERN_WARNING "ERROR: THE MAXIMUM SETTABLE MESSAGE SIZE IS FROM 1 TO %u BYTES!", maximum_message_size );
+				return -EINVAL;
+			}
+			
+			error = __mailslot_lock( ms, non_blocking );
+			
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+			
+			error = __mailslot_reconfigure( ms, ms->engine, arg, ms->storage );
+			if ( error ) {
+				if ( error == -EBUSY ) debug_printk( KERN_WARNING "ERROR: CAN'T RESIZE THE RING OF A NON-EMPTY OR MAPPED MAILSLOT! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return error;
+			}
+
+			debug_printk( KERN_INFO "MAXIMUM MESSAGE SIZE SETTED TO %zu BYTES! SLOT N°: %d", ms->max_msg_size, ms->slot );
+			__mailslot_unlock( ms );
+			break;
+
+		case SET_OVERFLOW_POLICY:
+			debug_printk( KERN_INFO "SETTING OVERFLOW POLICY (%d)...", (int) arg );
+			if ( arg != MAILSLOT_OVERFLOW_BLOCK && arg != MAILSLOT_OVERFLOW_OVERWRITE ) {
+				debug_printk( KERN_WARNING "ERROR: UNKNOWN OVERFLOW POLICY!" );
+				return -EINVAL;
+			}
+
+			error = __mailslot_lock( ms, non_blocking );
+
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+
+			// Evicting takes both queue locks: the lockless consumers can't be overtaken
+			if ( arg == MAILSLOT_OVERFLOW_OVERWRITE && (ms->engine == MAILSLOT_ENGINE_SHARED || ms->spsc || ms->sharded || ms->broadcast) ) {
+				debug_printk( KERN_WARNING "ERROR: THE OVERWRITE POLICY NEEDS THE LIST OR RING ENGINE, OUTSIDE OF THE SPSC, SHARDED AND BROADCAST MODES! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return -EINVAL;
+			}
+
+			__queue_lock_both( ms );
+			WRITE_ONCE( ms->overflow, arg );
+			__queue_unlock_both( ms );
+
+			debug_printk( KERN_INFO "OVERFLOW POLICY SETTED TO %d! SLOT N°: %d", (int) arg, ms->slot );
+			__mailslot_unlock( ms );
+
+			// The waiting writers no longer have to
+			wake_up_interruptible_all( &ms->write_queue );
+			break;
+
+		case SET_STORAGE_ENGINE:
+			debug_printk( KERN_INFO "SETTING STORAGE ENGINE (%d)...", (int) arg );
+			if ( arg != MAILSLOT_ENGINE_LIST && arg != MAILSLOT_ENGINE_RING && arg != MAILSLOT_ENGINE_SHARED ) {
+				debug_printk( KERN_WARNING "ERROR: UNKNOWN STORAGE ENGINE!" );
+				return -EINVAL;
+			}
+
+			error = __mailslot_lock( ms, non_blocking );
+
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+
+			error = __mailslot_reconfigure( ms, arg, ms->max_msg_size, ms->storage );
+			if ( error ) {
+				if ( error == -EBUSY ) debug_printk( KERN_WARNING "ERROR: CAN'T CHANGE THE STORAGE ENGINE OF A NON-EMPTY OR MAPPED MAILSLOT! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return error;
+			}
+
+			debug_printk( KERN_INFO "STORAGE ENGINE SETTED TO %d! SLOT N°: %d", (int) arg, ms->slot );
+			__mailslot_unlock( ms );
+			break;
+
+		case SET_MAILSLOT_STORAGE:
+			debug_printk( KERN_INFO "SETTING STORAGE BUDGET (%lu)...", arg );
+			if ( arg == 0 || arg > STORAGE_LIMIT ) {
+				debug_printk( KERN_WARNING "ERROR: THE STORAGE OF A MAILSLOT IS FROM 1 TO %d BYTES!", STORAGE_LIMIT );
+				return -EINVAL;
+			}
+
+			error = __mailslot_lock( ms, non_blocking );
+
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+
+			error = __mailslot_reconfigure( ms, ms->engine, ms->max_msg_size, arg );
+			if ( error ) {
+				if ( error == -EBUSY ) debug_printk( KERN_WARNING "ERROR: CAN'T RESIZE THE STORAGE OF A NON-EMPTY OR MAPPED MAILSLOT! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return error;
+			}
+
+			debug_printk( KERN_INFO "STORAGE BUDGET SETTED TO %zu BYTES! SLOT N°: %d", ms->storage, ms->slot );
+			__mailslot_unlock( ms );
+
+			// A larger budget may let the waiting writers in
+			wake_up_interruptible_poll( &ms->write_queue, EPOLLOUT | EPOLLWRNORM );
+			break;
+
+		case MAILSLOT_GET_INFO:
+			info.max_msg_size = READ_ONCE( ms->max_msg_size );
+			if ( READ_ONCE( ms->broadcast ) ) __broadcast_info( ms, __get_session( filp ), &info );	// What this file gets to read
+			else {
+				info.next_size = __mailslot_peek( ms );
+				info.msg_count = __mailslot_depth( ms );
+			}
+			info.reserved = 0;
+			if ( copy_to_user( (struct mailslot_info __user*) arg, &info, sizeof(info) ) ) return -EFAULT;
+			break;
+
+		case GET_MAILSLOT_STORAGE:
+			error = put_user( (__u64) READ_ONCE( ms->storage ), (__u64 __user*) arg );
+			if ( error ) return error;
+			break;
+
+		case SET_SPSC_MODE:
+			debug_printk( KERN_INFO "SETTING SPSC MODE (%d)...", (int) arg );
+			if ( arg != 0 && arg != 1 ) {
+				debug_printk( KERN_WARNING "ERROR: THE SPSC MODE CAN ONLY BE 0 (OFF) OR 1 (ON)!" );
+				return -EINVAL;
+			}
+
+			error = __mailslot_lock( ms, non_blocking );
+
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+
+			if ( arg && (ms->engine != MAILSLOT_ENGINE_RING || ms->overflow) ) {
+				debug_printk( KERN_WARNING "ERROR: THE SPSC MODE NEEDS THE RING ENGINE, WITHOUT THE OVERWRITE POLICY! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return -EINVAL;
+			}
+
+			if ( arg && !ms->spsc ) {
+				__queue_lock_both( ms );	// Locked operations check the mode under their queue lock
+				WRITE_ONCE( ms->spsc, 1 );
+				__queue_unlock_both( ms );
+			}
+			else if ( !arg && ms->spsc ) {
+				__spsc_quiesce( ms );
+				__queue_lock_both( ms );
+				WRITE_ONCE( ms->spsc, 0 );
+				__queue_unlock_both( ms );
+				smp_store_release( &ms->spsc_busy, 0 );
+				// Lockless sleepers wait without the lock: send them all to the locked path
+				wake_up_interruptible_all( &ms->read_queue );
+				wake_up_interruptible_all( &ms->write_queue );
+			}
+
+			debug_printk( KERN_INFO "SPSC MODE SETTED TO %d! SLOT N°: %d", (int) arg, ms->slot );
+			__mailslot_unlock( ms );
+			break;
+
+		case SET_BROADCAST_MODE:
+			debug_printk( KERN_INFO "SETTING BROADCAST MODE (%d)...", (int) arg );
+			if ( arg != MAILSLOT_BROADCAST_OFF && arg != MAILSLOT_BROADCAST_BLOCK && arg != MAILSLOT_BROADCAST_DROP ) {
+				debug_printk( KERN_WARNING "ERROR: UNKNOWN BROADCAST MODE!" );
+				return -EINVAL;
+			}
+
+			error = __mailslot_lock( ms, non_blocking );
+
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+
+			error = __broadcast_configure( ms, arg );
+			if ( error ) {
+				if ( error == -EBUSY ) debug_printk( KERN_WARNING "ERROR: CAN'T SWITCH THE BROADCAST MODE OF A NON-EMPTY MAILSLOT! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return error;
+			}
+
+			debug_printk( KERN_INFO "BROADCAST MODE SETTED TO %d! SLOT N°: %d", (int) arg, ms->slot );
+			__mailslot_unlock( ms );
+			break;
+
+		case MAILSLOT_SUBSCRIBE:
+			if ( arg != 0 && arg != 1 ) {
+				debug_printk( KERN_WARNING "ERROR: THE SUBSCRIPTION CAN ONLY BE 0 (OFF) OR 1 (ON)!" );
+				return -EINVAL;
+			}
+
+			error = __broadcast_subscribe( ms, __get_session( filp ), arg );
+			if ( error ) {
+				debug_printk( KERN_WARNING "ERROR: THE MAILSLOT IS NOT IN BROADCAST MODE! SLOT N°: %d", ms->slot );
+				return error;
+			}
+			break;
+
+		case SET_SHARDED_MODE:
+			debug_printk( KERN_INFO "SETTING SHARDED MODE (%d)...", (int) arg );
+			if ( arg != 0 && arg != 1 ) {
+				debug_printk( KERN_WARNING "ERROR: THE SHARDED MODE CAN ONLY BE 0 (OFF) OR 1 (ON)!" );
+				return -EINVAL;
+			}
+
+			error = __mailslot_lock( ms, non_blocking );
+
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+
+			error = __sharded_configure( ms, arg );
+			if ( error ) {
+				if ( error == -EBUSY ) debug_printk( KERN_WARNING "ERROR: CAN'T SWITCH THE SHARDED MODE OF A NON-EMPTY MAILSLOT! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return error;
+			}
+
+			debug_printk( KERN_INFO "SHARDED MODE SETTED TO %d! SLOT N°: %d", (int) arg, ms->slot );
+			__mailslot_unlock( ms );
+			break;
+
+		case MAILSLOT_GET_MAP_SIZE:
+			error = __mailslot_lock( ms, non_blocking );
+
+			if ( (non_blocking) && (error == -EAGAIN) ) return -EAGAIN;
+			else if ( !(non_blocking) && (error == -EINTR) ) return -EINTR;
+
+			if ( ms->engine != MAILSLOT_ENGINE_SHARED ) {
+				debug_printk( KERN_WARNING "ERROR: THE MAILSLOT DOES NOT USE THE SHARED ENGINE! SLOT N°: %d", ms->slot );
+				__mailslot_unlock( ms );
+				return -EINVAL;
+			}
+
+			ring = rcu_dereference_protected( ms->shared, lockdep_is_held( &ms->mutex ) );
+			error = put_user( (__u64) ring->size, (__u64 __user*) arg );
+			__mailslot_unlock( ms );
+			if ( error ) return error;
+			break;
+
+		case MAILSLOT_NOTIFY:
+			__shared_notify( ms );
+			break;
+
+		case MAILSLOT_SEND_BATCH:
+			if ( copy_from_user( &batch, (struct mailslot_batch __user*) arg, sizeof(batch) ) ) return -EFAULT;
+			return __account_error( ms, __mailslot_send_batch( filp, &batch, &((struct mailslot_batch __user*) arg)->done, non_blocking ) );
+
+		case MAILSLOT_RECV_BATCH:
+			if ( copy_from_user( &batch, (struct mailslot_batch __user*) arg, sizeof(batch) ) ) return -EFAULT;
+			return __account_error( ms, __mailslot_recv_batch( filp, &batch, &((struct mailslot_batch __user*) arg)->done, non_blocking ) );
+
+		case MAILSLOT_RECV_ANY:
+			return __mailslot_recv_any( ms, (struct mailslot_recv_any __user*) arg, non_blocking );
+
+		default:
+			debug_printk( KERN_WARNING "ERROR: IOCTL COMMAND NOT IDENTIFIED! CODE: %u", cmd );
+			return -ENOTTY;
+			
+	}
+	
+	return SUCCESS;
+	
+}
+
+
+/* io_uring passthrough (IORING_OP_URING_CMD): MAILSLOT_SEND_BATCH and MAILSLOT_RECV_BATCH, with the struct mailslot_batch
+   in the command area of the SQE, complete with what the ioctl would return. The first attempt is inline and does not
+   wait: when it would have to, io_uring issues the command again from one of its workers, where the blocking policy
+   applies as usual. */
+static int mailslot_uring_cmd( struct io_uring_cmd* ioucmd, unsigned int issue_flags ) {
+
+	const struct mailslot_batch* sqe_batch = io_uring_sqe_cmd( ioucmd->sqe );
+	struct file* filp = ioucmd->file;
+	struct mailslot* ms = __get_mailslot( filp );
+	struct mailslot_batch batch;
+	int non_blocking = __get_blocking_policy( filp );
+	int inline_issue = issue_flags & IO_URING_F_NONBLOCK;
+	long ret;
+
+	// The SQE is mapped in userspace: each field is read once
+	batch.msgs = READ_ONCE( sqe_batch->msgs );
+	batch.count = READ_ONCE( sqe_batch->count );
+	batch.done = 0;
+
+	switch ( ioucmd->cmd_op ) {
+
+		case MAILSLOT_SEND_BATCH:
+			ret = __mailslot_send_batch( filp, &batch, NULL, non_blocking || inline_issue );
+			break;
+
+		case MAILSLOT_RECV_BATCH:
+			ret = __mailslot_recv_batch( filp, &batch, NULL, non_blocking || inline_issue );
+			break;
+
+		default:
+			debug_printk( KERN_WARNING "ERROR: IO_URING COMMAND NOT IDENTIFIED! CODE: %u", ioucmd->cmd_op );
+			return -ENOTTY;
+	}
+
+	if ( ret == -EFAULT && inline_issue && !non_blocking ) return -EAGAIN;	// A buffer not resident yet: the worker takes the fault
+
+	if ( ret == -EAGAIN && inline_issue ) {
+		if ( !non_blocking ) return -EAGAIN;	// Issued again from a worker, which may sleep
+		// Completed here: returned, it would be retried as well. io_uring_cmd_done() lost its res2 argument in Linux 6.18.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 18, 0 )
+		io_uring_cmd_done( ioucmd, __account_error( ms, ret ), issue_flags );
+#else
+		io_uring_cmd_done( ioucmd, __account_error( ms, ret ), 0, issue_flags );
+#endif
+		return -EIOCBQUEUED;
+	}
+
+	return __account_error( ms, ret );
+
+}
+
+
+static __poll_t mailslot_poll( struct file* filp, poll_table* wait ) {
+
+	struct mailslot* ms;
+	__poll_t mask = 0;
+
+	ms = __get_mailslot( filp );
+
+	// Register only on the queues this session can use: a reader is not woken when room is made, nor a writer on new messages
+	if ( filp->f_mode & FMODE_READ ) poll_wait( filp, &ms->read_queue, wait );
+	if ( filp->f_mode & FMODE_WRITE ) poll_wait( filp, &ms->write_queue, wait );
+
+	// Userspace users of a shared ring must notify the pollers: ask them to, before looking at the ring
+	if ( READ_ONCE( ms->engine ) == MAILSLOT_ENGINE_SHARED ) {
+		if ( filp->f_mode & FMODE_READ ) __shared_arm( ms, MAILSLOT_TRACE_READ );
+		if ( filp->f_mode & FMODE_WRITE ) __shared_arm( ms, MAILSLOT_TRACE_WRITE );
+	}
+
+	// A broadcast message is only there for the subscribers that have not read it yet
+	if ( READ_ONCE( ms->broadcast ) ? __broadcast_readable( ms, __get_session( filp ) ) : !__mailslot_empty( ms ) )
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	// Writable means that a message of the maximum size can be posted without blocking, as always under the overwrite policy
+	if ( READ_ONCE( ms->overflow ) == MAILSLOT_OVERFLOW_OVERWRITE || !__mailslot_full( ms, READ_ONCE( ms->max_msg_size ) ) )
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+
+}
+
+
+/* Map the shared ring of a mailslot using the shared engine: the header page and the cells, from offset 0 */
+static int mailslot_mmap( struct file* filp, struct vm_area_struct* vma ) {
+
+	struct mailslot* ms;
+	struct shared_ring* ring;
+	int error;
+
+	ms = __get_mailslot( filp );
+
+	if ( __mailslot_lock( ms, BLOCKING ) == -EINTR ) return -EINTR;
+
+	ring = rcu_dereference_protected( ms->shared, lockdep_is_held( &ms->mutex ) );
+
+	if ( ms->engine != MAILSLOT_ENGINE_SHARED || !ring ) {
+		debug_printk( KERN_WARNING "ERROR: THE MAILSLOT DOES NOT USE THE SHARED ENGINE! SLOT N°: %d", ms->slot );
+		__mailslot_unlock( ms );
+		return -EINVAL;
+	}
+
+	if ( vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > ring->size ) {
+		debug_printk( KERN_WARNING "ERROR: THE MAPPING EXCEEDS THE SHARED RING! SLOT N°: %d", ms->slot );
+		__mailslot_unlock( ms );
+		return -EINVAL;
+	}
+
+	error = remap_vmalloc_range( vma, ring->header, 0 );
+	if ( error ) {
+		__mailslot_unlock( ms );
+		return error;
+	}
+
+	vma->vm_ops = &shared_vm_ops;
+	vma->vm_private_data = ms;
+	atomic_inc( &ms->shared_maps );	// The first open() of the vma is not a vm_ops call
+
+	debug_printk( KERN_INFO "SHARED RING MAPPED! SLOT N°: %d", ms->slot );
+
+	__mailslot_unlock( ms );
+
+	return SUCCESS;
+
+}
+
+
+/* Fetch and validate the descriptors of a batch. Returns the descriptor array (to be released with
+   __batch_finish()) and sets *valid to the number of leading descriptors that can be attempted. */
+static struct mailslot_msg* __batch_fetch( struct mailslot_batch* batch, unsigned int* valid ) {
+
+	struct mailslot_msg* msgs;
+	unsigned int i;
+
+	if ( batch->count == 0 || batch->count > MAILSLOT_BATCH_MAX ) {
+		debug_printk( KERN_WARNING "ERROR: A BATCH HOLDS FROM 1 TO %d MESSAGES!", MAILSLOT_BATCH_MAX );
+		return ERR_PTR( -EINVAL );
+	}
+
+	msgs = kmalloc_array( batch->count, sizeof(struct mailslot_msg), GFP_KERNEL );
+	if ( !msgs ) return ERR_PTR( -ENOMEM );
+
+	if ( copy_from_user( msgs, u64_to_user_ptr( batch->msgs ), batch->count * sizeof(struct mailslot_msg) ) ) {
+		kfree( msgs );
+		return ERR_PTR( -EFAULT );
+	}
+
+	for ( i = 0; i < batch->count; i++ ) msgs[i].result = 0;
+
+	// Same checks as read()/write() on a single message: the batch stops at the first invalid one
+	for ( i = 0; i < batch->count; i++ ) {
+		if ( (msgs[i].flags & ~(MAILSLOT_MSG_PRIORITY | MAILSLOT_MSG_PRIORITY_MASK)) ||
+			(msgs[i].flags & MAILSLOT_MSG_PRIORITY_MASK) >= MAILSLOT_PRIORITIES || msgs[i].buffer == 0 || msgs[i].length == 0 ) {
+			msgs[i].result = -EINVAL;
+			break;
+		}
+	}
+
+	*valid = i;
+
+	return msgs;
+
+}
+
+
+/* Report the per-message results and the number of transferred messages (to udone, unless NULL), then
+   release the descriptors */
+static long __batch_finish( struct mailslot_batch* batch, __u32 __user* udone, struct mailslot_msg* msgs, unsigned int done, long error ) {
+
+	if ( copy_to_user( u64_to_user_ptr( batch->msgs ), msgs, batch->count * sizeof(struct mailslot_msg) ) ||
+		(udone && put_user( done, udone )) )
+		error = -EFAULT;
+	else if ( done > 0 )
+		error = done;	// Partial success is still a success: the per-message results tell what happened
+
+	kfree( msgs );
+
+	return error;
+
+}
+
+
+/* Post up to MAILSLOT_BATCH_MAX messages with a single lock acquisition and a single wakeup. Each
+   message is still atomic; the batch stops at the first message that does not fit. */
+static long __mailslot_send_batch( struct file* filp, struct mailslot_batch* batch, __u32 __user* udone, int non_blocking ) {
+
+	struct mailslot* ms;
+	struct mailslot_msg* msgs;
+	struct message *chain, **chain_tail, *new_msg;
+	struct iov_iter iter;
+	const char __user* buff;
+	unsigned int i, valid, built, done, priority, session_priority;
+	size_t len;
+	int engine;
+	long error;
+
+	ms = __get_mailslot( filp );
+	session_priority = READ_ONCE( __get_session( filp )->priority );
+
+	msgs = __batch_fetch( batch, &valid );
+	if ( IS_ERR( msgs ) ) return PTR_ERR( msgs );
+
+	for ( i = 0; i < valid; i++ ) {
+		if ( msgs[i].length > READ_ONCE( ms->max_msg_size ) ) {
+			msgs[i].result = -EPERM;
+			break;
+		}
+	}
+	valid = i;
+
+	done = 0;
+	error = msgs[0].result;
+	if ( valid == 0 ) goto out;
+
+retry:
+	if ( READ_ONCE( ms->broadcast ) ) {	// Messages are only published and read one at a time
+		error = -EINVAL;
+		goto out;
+	}
+
+	// SPSC and sharded modes: one lockless enqueue per message, only the first one may wait for room
+	if ( READ_ONCE( ms->spsc ) || READ_ONCE( ms->sharded ) ) {
+
+		for ( done = 0; done < valid; done++ ) {
+			error = import_ubuf( ITER_SOURCE, u64_to_user_ptr( msgs[done].buffer ), msgs[done].length, &iter );
+			if ( !error ) error = __lockless_write( ms, &iter, non_blocking, !non_blocking && done == 0 );
+			if ( error == -EOPNOTSUPP || (error == -EAGAIN && done > 0) ) break;
+			msgs[done].result = error;
+			if ( error < 0 ) break;
+		}
+
+		if ( done > 0 || error != -EOPNOTSUPP ) {
+			error = msgs[0].result;
+			goto out;
+		}
+	}
+
+	engine = READ_ONCE( ms->engine );
+	chain = NULL;
+	chain_tail = &chain;
+
+	// As in write(): list engine messages are built before taking the lock, ring buffers are faulted in
+	for ( built = 0; built < valid; built++ ) {
+
+		buff = u64_to_user_ptr( msgs[built].buffer );
+		len = msgs[built].length;
+
+		if ( engine == MAILSLOT_ENGINE_LIST ) {
+			priority = (msgs[built].flags & MAILSLOT_MSG_PRIORITY) ? (msgs[built].flags & MAILSLOT_MSG_PRIORITY_MASK) : session_priority;
+			error = import_ubuf( ITER_SOURCE, (void __user*) buff, len, &iter );
+			new_msg = error ? ERR_PTR( error ) : __message_build( ms, &iter, priority, non_blocking );
+			if ( IS_ERR( new_msg ) ) {
+				msgs[built].result = PTR_ERR( new_msg );
+				break;
+			}
+			*chain_tail = new_msg;
+			chain_tail = &new_msg->next;
+		}
+		else if ( !non_blocking && fault_in_readable( buff, len ) ) {
+			msgs[built].result = -EFAULT;
+			break;
+		}
+	}
+
+	error = msgs[0].result;
+	if ( built == 0 ) goto out;
+
+	error = __wait_writable( ms, msgs[0].length, non_blocking );	// On success the producer lock is held
+	if ( error ) {
+		__message_free_chain( chain );
+		goto out;
+	}
+
+	if ( ms->engine != engine || ms->spsc || ms->sharded || ms->broadcast ) {	// The (empty) slot switched engine or mode meanwhile
+		__producer_unlock( ms );
+		__message_free_chain( chain );
+		goto retry;
+	}
+
+	for ( done = 0; done < built; done++ ) {
+
+		len = msgs[done].length;
+
+		if ( len > ms->max_msg_size ) {
+			msgs[done].result = -EPERM;
+			break;
+		}
+
+		if ( __mailslot_full( ms, len ) ) {
+			if ( ms->overflow != MAILSLOT_OVERFLOW_OVERWRITE || !__overflow_evict( ms, len ) ) break;
+			if ( ms->engine != engine || __mailslot_full( ms, len ) ) break;	// The lock was dropped meanwhile
+		}
+
+		if ( engine != MAILSLOT_ENGINE_LIST ) {
+			error = import_ubuf( ITER_SOURCE, u64_to_user_ptr( msgs[done].buffer ), len, &iter );
+			if ( !error ) error = __inplace_enqueue( ms, &iter );
+			if ( error ) {
+				msgs[done].result = error;
+				break;
+			}
+		}
+		else {
+			new_msg = chain;
+			chain = chain->next;
+			__list_link( ms, new_msg );
+		}
+
+		msgs[done].result = len;
+
+		__account_enqueue( ms, len );
+		trace_mailslot_enqueue( ms->slot, len, __mailslot_depth( ms ) );
+	}
+
+	debug_printk( KERN_INFO "%u MESSAGES OF A BATCH DELIVERED TO MAILSLOT! SLOT N°: %d", done, ms->slot );
+
+	__producer_unlock( ms );
+
+	__message_free_chain( chain );	// Built, but there was no room left for them
+
+	if ( done == 0 && (msgs[0].result == -EFAULT || msgs[0].result == -EAGAIN) && engine != MAILSLOT_ENGINE_LIST && !non_blocking ) {
+		msgs[0].result = __shared_backoff();	// The buffer was faulted in but reclaimed before the copy, or userspace took the shared ring room
+		if ( msgs[0].result == SUCCESS ) goto retry;
+	}
+
+	// A single wakeup for the whole batch, able to wake as many exclusive readers as messages posted
+	if ( done > 0 ) __wake_readers( ms, done );
+
+	error = msgs[0].result;
+
+out:
+	return __batch_finish( batch, udone, msgs, done, error );
+
+}
+
+
+/* Receive up to MAILSLOT_BATCH_MAX messages with a single lock acquisition and a single wakeup. The
+   batch stops at the first message that does not fit the corresponding buffer. */
+static long __mailslot_recv_batch( struct file* filp, struct mailslot_batch* batch, __u32 __user* udone, int non_blocking ) {
+
+	struct mailslot* ms;
+	struct mailslot_msg* msgs;
+	struct message *chain, **chain_tail, *msg;
+	struct iov_iter iter;
+	unsigned int i, valid, taken, done;
+	ssize_t msg_len;
+	size_t bytes_left;
+	unsigned int busy_poll;
+	u64 stamp;
+	long error;
+
+	ms = __get_mailslot( filp );
+	busy_poll = READ_ONCE( __get_session( filp )->busy_poll );
+
+	msgs = __batch_fetch( batch, &valid );
+	if ( IS_ERR( msgs ) ) return PTR_ERR( msgs );
+
+	done = 0;
+	error = msgs[0].result;
+	if ( valid == 0 ) goto out;
+
+	// Ring records are copied under the lock with page faults disabled: fault the buffers in first
+	if ( !non_blocking && READ_ONCE( ms->engine ) != MAILSLOT_ENGINE_LIST ) {
+		for ( i = 0; i < valid; i++ ) {
+			if ( fault_in_writeable( u64_to_user_ptr( msgs[i].buffer ), msgs[i].length ) ) {
+				msgs[i].result = -EFAULT;
+				break;
+			}
+		}
+		valid = i;
+		error = msgs[0].result;
+		if ( valid == 0 ) goto out;
+	}
+
+retry:
+	if ( READ_ONCE( ms->broadcast ) ) {	// Messages are only published and read one at a time
+		error = -EINVAL;
+		goto out;
+	}
+
+	// SPSC and sharded modes: one lockless dequeue per message, only the first one may wait for a message
+	if ( READ_ONCE( ms->spsc ) || READ_ONCE( ms->sharded ) ) {
+
+		for ( done = 0; done < valid; done++ ) {
+			msg_len = import_ubuf( ITER_DEST, u64_to_user_ptr( msgs[done].buffer ), msgs[done].length, &iter );
+			if ( !msg_len ) msg_len = __lockless_read( ms, &iter, 0, non_blocking, !non_blocking && done == 0, busy_poll );
+			if ( msg_len == -EOPNOTSUPP || (msg_len == -EAGAIN && done > 0) ) break;
+			msgs[done].result = msg_len;
+			if ( msg_len < 0 ) break;
+		}
+
+		if ( done > 0 || msg_len != -EOPNOTSUPP ) {
+			error = msgs[0].result;
+			goto out;
+		}
+	}
+
+	error = __wait_readable( ms, non_blocking, busy_poll );	// On success the consumer lock is held
+	if ( error ) goto out;
+
+	if ( ms->spsc || ms->sharded || ms->broadcast ) {	// Switched to another mode meanwhile
+		__consumer_unlock( ms );
+		goto retry;
+	}
+
+	chain = NULL;
+	chain_tail = &chain;
+
+	for ( taken = 0; taken < valid && !__mailslot_empty( ms ); taken++ ) {
+
+		if ( ms->engine != MAILSLOT_ENGINE_LIST ) {
+			msg_len = import_ubuf( ITER_DEST, u64_to_user_ptr( msgs[taken].buffer ), msgs[taken].length, &iter );
+			if ( !msg_len ) msg_len = __inplace_dequeue( ms, &iter, 0, &stamp );
+			msgs[taken].result = msg_len;
+			if ( msg_len < 0 ) break;
+			__account_dequeue( ms, msg_len, stamp );
+		}
+		else {
+			if ( __list_peek( ms )->length > msgs[taken].length ) {
+				msgs[taken].result = -EMSGSIZE;
+				break;
+			}
+			msg = __list_unlink( ms, __list_lane( ms ) );	// Counted once delivered, by __list_release()
+			*chain_tail = msg;
+			chain_tail = &msg->next;
+		}
+	}
+
+	debug_printk( KERN_INFO "%u MESSAGES OF A BATCH TAKEN FROM MAILSLOT! SLOT N°: %d", taken, ms->slot );
+
+	__consumer_unlock( ms );
+
+	if ( taken == 0 && msgs[0].result == -EAGAIN && !non_blocking ) {
+		msgs[0].result = __shared_backoff();	// A userspace consumer of the shared ring came first
+		if ( msgs[0].result == SUCCESS ) goto retry;
+	}
+
+	// List engine messages are copied to userspace outside the lock, as in read()
+	done = taken;
+	if ( chain ) {
+
+		for ( done = 0, msg = chain; msg; done++ ) {
+
+			bytes_left = import_ubuf( ITER_DEST, u64_to_user_ptr( msgs[done].buffer ), msgs[done].length, &iter ) ? msg->length : 0;
+
+			if ( bytes_left == 0 && non_blocking ) {
+				pagefault_disable();
+				bytes_left = __message_copy_out( msg, &iter, 0 );
+				pagefault_enable();
+			}
+			else if ( bytes_left == 0 ) bytes_left = __message_copy_out( msg, &iter, 0 );
+
+			if ( bytes_left > 0 ) {
+				msgs[done].result = -EFAULT;
+				break;
+			}
+
+			__list_release( ms, msg );
+			msgs[done].result = msg->length;
+			msgs[done].flags = MAILSLOT_MSG_PRIORITY | msg->priority;
+			chain = msg->next;
+			__message_free( msg );
+			msg = chain;
+		}
+
+		if ( msg ) __list_push_front( ms, msg );	// Not delivered: give them back to the slot, in order
+	}
+
+	if ( taken > 0 ) __wake_writers( ms, taken );
+
+	error = msgs[0].result;
+
+out:
+	return __batch_finish( batch, udone, msgs, done, error );
+
+}
+
+
+/* Receive a message from whichever of several mailslots (given by file descriptor) has one first, as
+   WaitForMultipleObjects() does for Windows handles: the mailslots are tried in order, and when all of them are
+   empty the caller sleeps on all their read queues at once. Each mailslot is read as read() on its own file would,
+   and a failure is counted against it; ms, the mailslot of the ioctl, is only charged with the EAGAIN of a caller
+   that finds them all empty. */
+static long __mailslot_recv_any( struct mailslot* ms, struct mailslot_recv_any __user* uarg, int non_blocking ) {
+
+	struct mailslot_recv_any arg;
+	struct file** files;
+	wait_queue_entry_t* waits;
+	struct kiocb kiocb;
+	struct iov_iter iter;
+	s32* fds;
+	unsigned int i, held;
+	long ret;
+
+	if ( copy_from_user( &arg, uarg, sizeof(arg) ) ) return -EFAULT;
+
+	if ( arg.count == 0 || arg.count > MAILSLOT_WAIT_MAX ) {
+		debug_printk( KERN_WARNING "ERROR: A WAIT ON MULTIPLE MAILSLOTS TAKES FROM 1 TO %d OF THEM!", MAILSLOT_WAIT_MAX );
+		return -EINVAL;
+	}
+
+	if ( arg.buffer == 0 || arg.length == 0 ) return -EINVAL;
+
+	fds = kmalloc_array( arg.count, sizeof(s32), GFP_KERNEL );
+	files = kcalloc( arg.count, sizeof(struct file*), GFP_KERNEL );
+	waits = kmalloc_array( arg.count, sizeof(wait_queue_entry_t), GFP_KERNEL );
+	held = 0;
+
+	if ( !fds || !files || !waits ) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if ( copy_from_user( fds, u64_to_user_ptr( arg.fds ), arg.count * sizeof(s32) ) ) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for ( held = 0; held < arg.count; held++ ) {
+		files[held] = fget( fds[held] );
+		if ( !files[held] || files[held]->f_op != &fops || !(files[held]->f_mode & FMODE_READ) ) {	// Not a mailslot open for reading, as for read()
+			if ( files[held] ) fput( files[held] );
+			ret = -EBADF;
+			goto out;
+		}
+	}
+
+retry:
+	// Messages are copied with page faults disabled, as for a non-blocking read()
+	if ( !non_blocking && fault_in_writeable( u64_to_user_ptr( arg.buffer ), arg.length ) ) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for ( i = 0; i < arg.count; i++ ) {
+
+		ret = import_ubuf( ITER_DEST, u64_to_user_ptr( arg.buffer ), arg.length, &iter );
+		if ( ret ) goto out;
+
+		init_sync_kiocb( &kiocb, files[i] );
+		kiocb.ki_flags |= IOCB_NOWAIT;
+
+		ret = __mailslot_read( &kiocb, &iter );
+		if ( ret == -EFAULT && !non_blocking ) goto retry;	// Reclaimed before the copy
+		if ( ret != -EAGAIN ) break;
+	}
+
+	if ( i < arg.count ) {	// Delivered, or failed, by mailslot i
+		if ( ret < 0 ) {
+			trace_mailslot_error( __get_mailslot( files[i] )->slot, MAILSLOT_TRACE_READ, arg.length, ret );
+			__account_error( __get_mailslot( files[i] ), ret );
+		}
+		if ( put_user( i, &uarg->index ) || put_user( first_minor + __get_mailslot( files[i] )->slot, &uarg->minor ) ) ret = -EFAULT;
+		goto out;
+	}
+
+	if ( non_blocking ) {
+		__account_error( ms, ret );
+		goto out;
+	}
+
+	// As wait_event_interruptible(), on all the read queues: every message posted to any of them wakes the caller
+	for ( i = 0; i < arg.count; i++ ) {
+		init_waitqueue_entry( &waits[i], current );
+		add_wait_queue( &__get_mailslot( files[i] )->read_queue, &waits[i] );
+	}
+
+	set_current_state( TASK_INTERRUPTIBLE );
+
+	for ( i = 0; i < arg.count && !__recv_any_ready( files[i] ); i++ );
+
+	if ( i == arg.count && !signal_pending( current ) ) schedule();
+
+	__set_current_state( TASK_RUNNING );
+
+	for ( i = 0; i < arg.count; i++ ) remove_wait_queue( &__get_mailslot( files[i] )->read_queue, &waits[i] );
+
+	if ( signal_pending( current ) ) {
+		ret = -EINTR;
+		goto out;
+	}
+
+	goto retry;
+
+out:
+	for ( i = 0; i < held; i++ ) fput( files[i] );
+
+	kfree( waits );
+	kfree( files );
+	kfree( fds );
+
+	return ret;
+
+}
+
+
+/* Wait condition of __mailslot_recv_any() for one of its files: a read() of it would not wait */
+static int __recv_any_ready( struct file* filp ) {
+
+	struct mailslot* ms = __get_mailslot( filp );
+
+	if ( READ_ONCE( ms->broadcast ) ) return __broadcast_readable( ms, __get_session( filp ) );
+
+	return __wait_readable_cond( ms );
+
+}
+
+
+static void __deallocate_instances( void ) {
+
+	struct mailslot* ms;
+	unsigned long i;
+
+	xa_for_each( &mailslots, i, ms ) {
+		if ( ms->created ) device_destroy( mailslot_class, MKDEV( MAJOR( dev ), MINOR( dev ) + i ) );
+		__mailslot_free( ms );
+	}
+
+	if ( !IS_ERR_OR_NULL( mailslot_class ) ) class_destroy( mailslot_class );
+
+	xa_destroy( &mailslots );
+
+	kmem_cache_destroy( mailslot_cache );
+
+}
+
+
+static int __get_slot( struct file* filp ) {
+
+	return iminor( filp->f_path.dentry->d_inode ) - first_minor;
+
+}
+
+
+static struct session* __get_session( struct file* filp ) {
+
+	return filp->private_data;	// Set by mailslot_open()
+
+}
+
+
+static struct mailslot* __get_mailslot( struct file* filp ) {
+
+	return __get_session( filp )->ms;
+
+}
+
+
+static struct mailslot* __mailslot_alloc( int slot, int payload_node ) {
+
+	int node = payload_node == NUMA_NO_NODE ? numa_node_id() : payload_node;
+	struct mailslot* ms = kmem_cache_alloc_node( mailslot_cache, GFP_KERNEL | __GFP_ZERO, node );
+	int i;
+
+	if ( !ms ) return NULL;
+
+	ms->stats = alloc_percpu( struct mailslot_counters );
+
+	if ( !ms->stats ) {
+		kmem_cache_free( mailslot_cache, ms );
+		return NULL;
+	}
+
+	ms->slot = slot;
+	init_waitqueue_head( &ms->read_queue );
+	init_waitqueue_head( &ms->write_queue );
+	mutex_init( &ms->mutex );
+	spin_lock_init( &ms->consumer_lock );
+	spin_lock_init( &ms->producer_lock );
+	atomic_set( &ms->msg_count, 0 );
+	ms->max_msg_size = default_message_size;
+	ms->storage = storage;
+	ms->engine = MAILSLOT_ENGINE_LIST;
+	ms->numa_node = payload_node;
+	ms->reader_node = NUMA_NO_NODE;
+	INIT_LIST_HEAD( &ms->subscribers );
+
+	// Dummy node of each lane, so that the producer never has to touch the head
+	for ( i = 0; i < MAILSLOT_PRIORITIES; i++ ) {
+
+		ms->head[i] = ms->tail[i] = kzalloc_node( sizeof(struct message), GFP_KERNEL, node );
+
+		if ( !ms->head[i] ) {
+			__mailslot_free( ms );
+			return NULL;
+		}
+	}
+
+	return ms;
+
+}
+
+
+static void __mailslot_free( struct mailslot* ms ) {
+
+	int i, cpu;
+
+	// The dummy nodes and the queued messages
+	for ( i = 0; i < MAILSLOT_PRIORITIES; i++ ) __message_free_chain( ms->head[i] );
+
+	// The retained broadcast messages
+	if ( ms->bcast )
+		for ( i = 0; i < MAILSLOT_BROADCAST_DEPTH; i++ )
+			if ( ms->bcast[i] ) __message_free( ms->bcast[i] );
+	kfree( ms->bcast );
+
+	// The messages left in the shards
+	if ( ms->shards )
+		for_each_possible_cpu( cpu ) __message_free_chain( per_cpu_ptr( ms->shards, cpu )->head );
+	free_percpu( ms->shards );
+
+	kvfree( ms->ring );
+	__shared_free( rcu_dereference_protected( ms->shared, 1 ) );
+	free_percpu( ms->stats );
+
+	kmem_cache_free( mailslot_cache, ms );
+
+}
+
+
+/* A slot can be released once closed only if a new allocation would be indistinguishable from it */
+static int __mailslot_idle( struct mailslot* ms ) {
+
+	return __mailslot_empty( ms ) && ms->engine == MAILSLOT_ENGINE_LIST && !ms->broadcast && !ms->overflow && !ms->sharded && ms->max_msg_size == default_message_size &&
+		ms->storage == storage && ms->numa_node == numa_node && !ms->created;
+
+}
+
+
+/* Counters of a message posted by the driver. The high-water mark is only written when it grows. */
+static void __account_enqueue( struct mailslot* ms, size_t len ) {
+
+	unsigned int depth = __mailslot_depth( ms );
+
+	this_cpu_inc( ms->stats->msgs_in );
+	this_cpu_add( ms->stats->bytes_in, len );
+
+	if ( depth > READ_ONCE( ms->depth_hwm ) ) WRITE_ONCE( ms->depth_hwm, depth );
+
+}
+
+
+/* Counters of a message taken by the driver, stamped at enqueue. Stamps of the shared ring cells come
+   from userspace as well: only the plausible ones make it to the histogram. */
+static void __account_dequeue( struct mailslot* ms, size_t len, u64 stamp ) {
+
+	u64 now = ktime_get_ns();
+	u64 residency = 0;
+
+	this_cpu_inc( ms->stats->msgs_out );
+	this_cpu_add( ms->stats->bytes_out, len );
+
+	if ( stamp && stamp <= now ) {
+		residency = now - stamp;
+		this_cpu_inc( ms->stats->residency[__latency_bucket( residency )] );
+	}
+
+	trace_mailslot_dequeue( ms->slot, len, __mailslot_depth( ms ), residency );
+
+}
+
+
+/* NUMA counters of a list engine message taken by a reader, who also becomes the consumer whose node the
+   payloads are allocated on (unless the mailslot has a node set) */
+static void __account_numa( struct mailslot* ms, struct message* msg ) {
+
+	int node = numa_node_id();
+	struct page* page = msg->pages ? msg->pages[0] : virt_to_page( msg->content );
+
+	if ( READ_ONCE( ms->reader_node ) != node ) WRITE_ONCE( ms->reader_node, node );	// Shared with the writers: only written on a change
+
+	if ( page_to_nid( page ) == node ) this_cpu_inc( ms->stats->numa_local );
+	else this_cpu_inc( ms->stats->numa_remote );
+
+}
+
+
+/* Node the payloads and the storage of a mailslot are allocated on: the one set through SET_NUMA_NODE, otherwise
+   the one of the last reader (NUMA_NO_NODE, so the local node of the writer, before the first read) */
+static int __message_node( struct mailslot* ms ) {
+
+	int node = READ_ONCE( ms->numa_node );
+
+	return node != NUMA_NO_NODE ? node : READ_ONCE( ms->reader_node );
+
+}
+
+
+static int __latency_bucket( u64 ns ) {
+
+	return min( fls64( ns >> LATENCY_SHIFT ), LATENCY_BUCKETS - 1 );
+
+}
+
+
+/* Count the failures worth watching; the error is returned as it is */
+static long __account_error( struct mailslot* ms, long error ) {
+
+	if ( error == -EAGAIN ) this_cpu_inc( ms->stats->eagain );
+	else if ( error == -EMSGSIZE ) this_cpu_inc( ms->stats->emsgsize );
+
+	return error;
+
+}
+
+
+/* A sleep on a wait queue, started at blocked, is over */
+static void __account_wake( struct mailslot* ms, int op, u64 blocked ) {
+
+	blocked = ktime_get_ns() - blocked;
+
+	this_cpu_add( ms->stats->blocked_ns, blocked );
+	if ( op == MAILSLOT_TRACE_WRITE ) this_cpu_inc( ms->stats->write_blocked[__latency_bucket( blocked )] );
+
+	trace_mailslot_wake( ms->slot, op, blocked );
+
+}
+
+
+/* Raw sum of the per-CPU counters. Not a snapshot: the counters keep moving while they are summed. */
+static void __counters_sum( struct mailslot* ms, struct mailslot_counters* sum ) {
+
+	u64* cpu_counters;
+	int cpu, i;
+
+	memset( sum, 0, sizeof(*sum) );
+
+	for_each_possible_cpu( cpu ) {
+		cpu_counters = (u64*) per_cpu_ptr( ms->stats, cpu );
+		for ( i = 0; i < MAILSLOT_COUNTERS; i++ )
+			( (u64*) sum )[i] += READ_ONCE( cpu_counters[i] );
+	}
+
+}
+
+
+/* Counters since the last reset. Called with instances_lock held. */
+static void __counters_read( struct mailslot* ms, struct mailslot_counters* counters ) {
+
+	int i;
+
+	__counters_sum( ms, counters );
+
+	for ( i = 0; i < MAILSLOT_COUNTERS; i++ )
+		( (u64*) counters )[i] -= ( (u64*) &ms->stats_base )[i];
+
+}
+
+
+static void __counters_add( struct mailslot_counters* sum, struct mailslot_counters* counters ) {
+
+	int i;
+
+	for ( i = 0; i < MAILSLOT_COUNTERS; i++ )
+		( (u64*) sum )[i] += ( (u64*) counters )[i];
+
+}
+
+
+static void __counters_print( struct seq_file* m, struct mailslot_counters* c ) {
+
+	seq_printf( m, " %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n", c->msgs_in, c->bytes_in, c->msgs_out,
+		c->bytes_out, c->eagain, c->emsgsize, c->contended, c->blocked_ns, c->polled, c->dropped, c->stolen, c->numa_local,
+		c->numa_remote );
+
+}
+
+
+/* debugfs "stats": a line per live slot, then the totals (released slots included) */
+static int mailslot_stats_show( struct seq_file* m, void* unused ) {
+
+	struct mailslot_counters counters, total;
+	struct mailslot* ms;
+	unsigned long slot;
+
+	seq_puts( m, "slot depth depth_hwm node msgs_in bytes_in msgs_out bytes_out eagain emsgsize contended blocked_ns polled dropped stolen numa_local numa_remote\n" );
+
+	mutex_lock( &instances_lock );
+
+	total = retired_stats;
+
+	xa_for_each( &mailslots, slot, ms ) {
+		__counters_read( ms, &counters );
+		__counters_add( &total, &counters );
+		seq_printf( m, "%lu %d %u %d", slot, __mailslot_depth( ms ), READ_ONCE( ms->depth_hwm ), __message_node( ms ) );
+		__counters_print( m, &counters );
+	}
+
+	mutex_unlock( &instances_lock );
+
+	seq_puts( m, "total - - -" );
+	__counters_print( m, &total );
+
+	return SUCCESS;
+
+}
+
+
+static void __latency_print( struct seq_file* m, const char* slot, const char* name, u64* buckets ) {
+
+	int i;
+
+	seq_printf( m, "%s %s", slot, name );
+
+	for ( i = 0; i < LATENCY_BUCKETS; i++ )
+		seq_printf( m, " %llu", buckets[i] );
+
+	seq_putc( m, '\n' );
+
+}
+
+
+/* debugfs "latency": residency and writer sleep histograms, per live slot and in total. The header
+   line has the lower bound (ns) of each bucket. */
+static int mailslot_latency_show( struct seq_file* m, void* unused ) {
+
+	struct mailslot_counters counters, total;
+	struct mailslot* ms;
+	unsigned long slot;
+	char name[24];
+	int i;
+
+	seq_puts( m, "slot histogram 0" );
+	for ( i = 1; i < LATENCY_BUCKETS; i++ )
+		seq_printf( m, " %llu", 1ULL << (i - 1 + LATENCY_SHIFT) );
+	seq_putc( m, '\n' );
+
+	mutex_lock( &instances_lock );
+
+	total = retired_stats;
+
+	xa_for_each( &mailslots, slot, ms ) {
+		__counters_read( ms, &counters );
+		__counters_add( &total, &counters );
+		snprintf( name, sizeof(name), "%lu", slot );
+		__latency_print( m, name, "residency", counters.residency );
+		__latency_print( m, name, "write_blocked", counters.write_blocked );
+	}
+
+	mutex_unlock( &instances_lock );
+
+	__latency_print( m, "total", "residency", total.residency );
+	__latency_print( m, "total", "write_blocked", total.write_blocked );
+
+	return SUCCESS;
+
+}
+
+
+/* debugfs "reset": any write starts the counters over, without stopping the traffic */
+static ssize_t mailslot_stats_reset( struct file* filp, const char __user* buff, size_t len, loff_t* off ) {
+
+	struct mailslot* ms;
+	unsigned long slot;
+
+	mutex_lock( &instances_lock );
+
+	memset( &retired_stats, 0, sizeof(retired_stats) );
+
+	xa_for_each( &mailslots, slot, ms ) {
+		__counters_sum( ms, &ms->stats_base );
+		WRITE_ONCE( ms->depth_hwm, __mailslot_depth( ms ) );
+	}
+
+	mutex_unlock( &instances_lock );
+
+	debug_printk( KERN_INFO "MAILSLOT COUNTERS RESET!" );
+
+	return len;
+
+}
+
+
+static int __get_blocking_policy( struct file* filp ) {
+
+	return filp->f_flags & O_NONBLOCK ? NONBLOCKING : BLOCKING;
+	
+}
+
+
+static int __mailslot_lock( struct mailslot* ms, int non_blocking ) {
+	
+	if ( non_blocking ) {
+		if ( mutex_trylock( &ms->mutex ) == 0 ) { 
+			debug_printk( KERN_WARNING "ERROR: FAILED TO ACQUIRE THE LOCK - NONBLOCKING POLICY" );
+			return -EAGAIN;
+		}				
+	}
+	
+	else { // The default behaviour is a blocking policy
+		if ( mutex_lock_interruptible( &ms->mutex ) == -EINTR ) {
+			debug_printk( KERN_WARNING "ERROR: FAILED TO ACQUIRE THE LOCK - BLOCKING POLICY" );
+			return -EINTR;
+		}	
+	}
+	
+	return SUCCESS;
+	
+}
+
+
+static void __mailslot_unlock( struct mailslot* ms ) {
+
+	mutex_unlock( &ms->mutex );
+
+}
+
+
+/* Queue locks: spinlocks, since the critical sections never sleep (ring copies run with page faults
+   disabled), so a non-blocking caller is never turned away just because the lock is contended */
+static void __consumer_lock( struct mailslot* ms ) {
+
+	if ( spin_trylock( &ms->consumer_lock ) ) return;
+
+	this_cpu_inc( ms->stats->contended );
+	spin_lock( &ms->consumer_lock );
+
+}
+
+
+static void __consumer_unlock( struct mailslot* ms ) {
+
+	spin_unlock( &ms->consumer_lock );
+
+}
+
+
+static void __producer_lock( struct mailslot* ms ) {
+
+	if ( spin_trylock( &ms->producer_lock ) ) return;
+
+	this_cpu_inc( ms->stats->contended );
+	spin_lock( &ms->producer_lock );
+
+}
+
+
+static void __producer_unlock( struct mailslot* ms ) {
+
+	spin_unlock( &ms->producer_lock );
+
+}
+
+
+/* Both sides, for the configuration changes and the rare paths that touch both ends of the queue */
+static void __queue_lock_both( struct mailslot* ms ) {
+
+	spin_lock( &ms->consumer_lock );
+	spin_lock( &ms->producer_lock );
+
+}
+
+
+static void __queue_unlock_both( struct mailslot* ms ) {
+
+	spin_unlock( &ms->producer_lock );
+	spin_unlock( &ms->consumer_lock );
+
+}
+
+
+/* Acquire the consumer lock and wait until the mailslot holds a message, busy polling for up to busy_poll
+   microseconds before sleeping. On success the lock is held. */
+static int __wait_readable( struct mailslot* ms, int non_blocking, unsigned int busy_poll ) {
+
+	u64 blocked;
+	int interrupted;
+
+	__consumer_lock( ms );
+
+	if ( non_blocking ) {
+
+		if ( __mailslot_empty( ms ) ) {
+			debug_printk( KERN_INFO "THE MAILSLOT IS EMPTY. SLOT N°: %d", ms->slot );
+			__consumer_unlock( ms );
+			return -EAGAIN;
+		}
+	}		
+	else { // The default behaviour is a blocking policy
+
+		if ( busy_poll && __mailslot_empty( ms ) ) {
+			__consumer_unlock( ms );
+			__busy_poll( ms, busy_poll );
+			__consumer_lock( ms );
+		}
+
+		while ( __mailslot_empty( ms ) ) {
+			__consumer_unlock( ms );
+			trace_mailslot_block( ms->slot, MAILSLOT_TRACE_READ );
+			blocked = ktime_get_ns();
+			interrupted = wait_event_interruptible_exclusive( ms->read_queue, __wait_readable_cond( ms ) );
+			__account_wake( ms, MAILSLOT_TRACE_READ, blocked );
+			if ( interrupted ) return -EINTR;	 
+			__consumer_lock( ms );
+		} 				
+	}
+
+	return SUCCESS;
+
+}
+
+
+/* Acquire the producer lock and wait until a message of len bytes fits. On success the lock is held. */
+static int __wait_writable( struct mailslot* ms, size_t len, int non_blocking ) {
+
+	u64 blocked;
+	int interrupted;
+
+	__producer_lock( ms );
+
+	// Overwrite policy: the oldest messages make room, unless it is held by a splice in progress. The lock may be
+	// dropped meanwhile, so this comes before the checks.
+	while ( ms->overflow == MAILSLOT_OVERFLOW_OVERWRITE && len <= ms->max_msg_size && __mailslot_full( ms, len ) &&
+		__overflow_evict( ms, len ) );
+
+	// Checked before waiting: a message that can never fit must not block the writer forever
+	if ( len > ms->max_msg_size ) {
+		debug_printk( KERN_WARNING "ERROR: CAN'T WRITE. MESSAGE TOO BIG! MAXIMUM NUMBER OF CHARACTERS IS %zu!", ms->max_msg_size );
+		__producer_unlock( ms );
+		return -EPERM;
+	}
+
+	if ( non_blocking ) {
+
+		if ( __mailslot_full( ms, len ) ) {
+			debug_printk( KERN_WARNING "ERROR: CAN'T WRITE. THE MAILSLOT IS FULL! SLOT N°: %d", ms->slot );
+			__producer_unlock( ms );
+			return -EAGAIN;
+		}
+	}
+	else { // The default behaviour is a blocking policy
+
+		while ( __mailslot_full( ms, len ) ) {
+			__producer_unlock( ms );
+			trace_mailslot_block( ms->slot, MAILSLOT_TRACE_WRITE );
+			blocked = ktime_get_ns();
+			interrupted = wait_event_interruptible_exclusive( ms->write_queue, __wait_writable_cond( ms, len ) );
+			__account_wake( ms, MAILSLOT_TRACE_WRITE, blocked );
+			if ( interrupted ) return -EINTR;			 
+			__producer_lock( ms );
+		} 				
+	}
+
+	return SUCCESS;
+
+}
+
+
+/* Overwrite policy: evict the oldest messages until one of len bytes fits; with priorities, the oldest of the lowest
+   non-empty lane. Called with the producer lock held, which is dropped meanwhile to take both queue locks in order;
+   the evicted messages are freed without any lock held. Returns how many were evicted. */
+static int __overflow_evict( struct mailslot* ms, size_t len ) {
+
+	struct message *chain = NULL, *msg;
+	int evicted = 0;
+
+	__producer_unlock( ms );
+	__queue_lock_both( ms );
+
+	while ( ms->overflow == MAILSLOT_OVERFLOW_OVERWRITE && __mailslot_full( ms, len ) && !__mailslot_empty( ms ) ) {
+
+		if ( ms->engine == MAILSLOT_ENGINE_LIST ) {
+			msg = __list_unlink( ms, __ffs( ms->lanes ) );
+			atomic_long_sub( LIST_FOOTPRINT( msg->length ), &ms->msg_bytes );	// Dropped, not delivered
+			msg->next = chain;
+			chain = msg;
+		}
+		else __ring_evict( ms );
+
+		evicted++;
+	}
+
+	__queue_unlock_both( ms );
+
+	if ( evicted ) {
+		this_cpu_add( ms->stats->dropped, evicted );
+		debug_printk( KERN_INFO "%d MESSAGES EVICTED TO MAKE ROOM! SLOT N°: %d", evicted, ms->slot );
+	}
+
+	__message_free_chain( chain );
+
+	__producer_lock( ms );
+
+	return evicted;
+
+}
+
+
+/* Busy polling of a blocking reader (SET_BUSY_POLL): spin on the mailslot for up to usecs microseconds rather than
+   paying a sleep and a wakeup. Given up early for a pending signal or another task wanting the CPU. Returns 1 if a
+   message showed up, which a concurrent reader may still take first. */
+static int __busy_poll( struct mailslot* ms, unsigned int usecs ) {
+
+	u64 end = local_clock() + (u64) usecs * NSEC_PER_USEC;
+
+	while ( __mailslot_empty( ms ) ) {
+		if ( signal_pending( current ) || need_resched() || local_clock() > end ) return 0;
+		cpu_relax();
+	}
+
+	this_cpu_inc( ms->stats->polled );
+
+	return 1;
+
+}
+
+
+/* Wakeups skip the wait queue lock when nobody waits: the full barrier of wq_has_sleeper() pairs with the one
+   of a task queueing itself, which evaluates its wait condition afterwards and so sees the new state */
+static void __wake_readers( struct mailslot* ms, int nr ) {
+
+	if ( wq_has_sleeper( &ms->read_queue ) )
+		__wake_up( &ms->read_queue, TASK_INTERRUPTIBLE, nr, poll_to_key( EPOLLIN | EPOLLRDNORM ) );
+
+}
+
+
+static void __wake_writers( struct mailslot* ms, int nr ) {
+
+	if ( wq_has_sleeper( &ms->write_queue ) )
+		__wake_up( &ms->write_queue, TASK_INTERRUPTIBLE, nr, poll_to_key( EPOLLOUT | EPOLLWRNORM ) );
+
+}
+
+
+static int __mailslot_full( struct mailslot* ms, size_t len ) {
+
+	// Broadcast mode: the drop mode makes room by itself
+	if ( READ_ONCE( ms->broadcast ) ) return READ_ONCE( ms->broadcast ) == MAILSLOT_BROADCAST_BLOCK && !__broadcast_room( ms, len );
+
+	if ( ms->engine == MAILSLOT_ENGINE_SHARED ) return __shared_full( ms );
+
+	if ( ms->engine == MAILSLOT_ENGINE_RING ) return __ring_full( ms, len );
+
+	return atomic_long_read( &ms->msg_bytes ) + LIST_FOOTPRINT( len ) > READ_ONCE( ms->storage );
+
+}
+
+
+/* Broadcast mode: never empty, since emptiness is per subscriber. The regular readers go on and take the broadcast path. */
+static int __mailslot_empty( struct mailslot* ms ) {
+
+	if ( READ_ONCE( ms->broadcast ) ) return 0;
+
+	if ( READ_ONCE( ms->engine ) == MAILSLOT_ENGINE_SHARED ) return __shared_empty( ms );
+
+	if ( READ_ONCE( ms->engine ) == MAILSLOT_ENGINE_RING ) return __ring_empty( ms );
+
+	return atomic_read_acquire( &ms->msg_count ) == 0;	// Acquire: pairs with the barrier of __list_link()
+
+}
+
+
+/* Number of queued messages, for diagnostics only: on a shared ring it is whatever userspace left in the header */
+static int __mailslot_depth( struct mailslot* ms ) {
+
+	struct shared_ring* ring;
+	int depth;
+
+	if ( READ_ONCE( ms->broadcast ) ) return READ_ONCE( ms->bcast_tail ) - READ_ONCE( ms->bcast_head );	// Retained messages
+
+	if ( READ_ONCE( ms->engine ) == MAILSLOT_ENGINE_RING ) return READ_ONCE( ms->ring_posted ) - READ_ONCE( ms->ring_taken );
+
+	if ( READ_ONCE( ms->engine ) != MAILSLOT_ENGINE_SHARED ) return atomic_read( &ms->msg_count );
+
+	depth = 0;
+	rcu_read_lock();
+	ring = rcu_dereference( ms->shared );
+	if ( ring )
+		depth = clamp_t( s64, READ_ONCE( ring->header->producer ) - READ_ONCE( ring->header->consumer ), 0, ring->cells );
+	rcu_read_unlock();
+
+	return depth;
+
+}
+
+
+/* Length of the next message, or MAILSLOT_NO_MESSAGE. Read under the consumer lock, so that the list head or
+   ring record looked at can't be released meanwhile (a lockless SPSC reader may still make it stale). */
+static u32 __mailslot_peek( struct mailslot* ms ) {
+
+	struct shared_ring* ring;
+	struct mailslot_shared_cell* cell;
+	struct ring_header* header;
+	u32 next = MAILSLOT_NO_MESSAGE;
+	u64 pos;
+
+	if ( READ_ONCE( ms->sharded ) ) return __shard_peek( ms );
+
+	__consumer_lock( ms );
+
+	if ( __mailslot_empty( ms ) || ms->broadcast || ms->sharded ) goto out;
+
+	if ( ms->engine == MAILSLOT_ENGINE_LIST ) next = __list_peek( ms )->length;
+	else if ( ms->engine == MAILSLOT_ENGINE_RING ) {
+		header = (struct ring_header*) (ms->ring + (READ_ONCE( ms->ring_head ) & (ms->ring_size - 1)));
+		next = READ_ONCE( header->length );
+	}
+	else {
+		ring = rcu_dereference_protected( ms->shared, lockdep_is_held( &ms->consumer_lock ) );
+		pos = READ_ONCE( ring->header->consumer );
+		cell = __shared_cell( ring, pos );
+		if ( smp_load_acquire( &cell->sequence ) == pos + 1 && READ_ONCE( cell->length ) <= ring->msg_size )
+			next = READ_ONCE( cell->length );
+	}
+
+out:
+	__consumer_unlock( ms );
+
+	return next;
+
+}
+
+
+/* Wait conditions of the blocked readers and writers: evaluated after queueing the task, so that the
+   waiter flags of a shared ring are raised before looking at it, as the userspace protocol requires */
+static int __wait_readable_cond( struct mailslot* ms ) {
+
+	if ( READ_ONCE( ms->engine ) == MAILSLOT_ENGINE_SHARED ) __shared_arm( ms, MAILSLOT_TRACE_READ );
+
+	return !__mailslot_empty( ms );
+
+}
+
+
+static int __wait_writable_cond( struct mailslot* ms, size_t len ) {
+
+	if ( READ_ONCE( ms->engine ) == MAILSLOT_ENGINE_SHARED ) __shared_arm( ms, MAILSLOT_TRACE_WRITE );
+
+	return !__mailslot_full( ms, len );
+
+}
+
+
+/* Apply a new storage engine, maximum message size and byte budget. Called with the mailslot lock held.
+   The new storage is allocated first, swapped in with both queue locks held (and the SPSC mode quiesced),
+   and the old one freed last. Storage is only replaced, which needs an empty and unmapped mailslot, when
+   the engine changes or the current storage cannot hold messages of the new size or the new budget.
+   A budget that cannot hold a single message of the maximum size is refused. */
+static int __mailslot_reconfigure( struct mailslot* ms, int engine, size_t max_msg_size, size_t storage ) {
+
+	struct shared_ring *shared, *old_shared;
+	char *ring, *old_ring;
+	size_t ring_size;
+	int replace, error;
+
+	if ( engine == MAILSLOT_ENGINE_SHARED && ms->overflow ) {
+		debug_printk( KERN_WARNING "ERROR: THE SHARED ENGINE CAN'T USE THE OVERWRITE POLICY! SLOT N°: %d", ms->slot );
+		return -EINVAL;
+	}
+
+	if ( engine != MAILSLOT_ENGINE_LIST && max_msg_size > RING_MESSAGE_LIMIT ) {
+		debug_printk( KERN_WARNING "ERROR: THE RING AND SHARED ENGINES TAKE MESSAGES OF UP TO %lu BYTES! SLOT N°: %d", RING_MESSAGE_LIMIT, ms->slot );
+		return -EINVAL;
+	}
+
+	if ( __message_footprint( engine, max_msg_size ) > storage ) {
+		debug_printk( KERN_WARNING "ERROR: A STORAGE OF %zu BYTES CAN'T HOLD A MESSAGE OF %zu BYTES! SLOT N°: %d", storage, max_msg_size, ms->slot );
+		return -EINVAL;
+	}
+
+	ring = NULL;
+	shared = NULL;
+	ring_size = roundup_pow_of_two( storage );	// The budget, not the ring size, bounds the records
+
+	if ( engine == MAILSLOT_ENGINE_RING && (ms->engine != engine || ring_size > ms->ring_size) ) {
+		ring = kvmalloc_node( ring_size, GFP_KERNEL, __message_node( ms ) );	// Not zeroed: a record is always written before it is read
+		if ( !ring ) return -ENOMEM;
+	}
+
+	old_shared = rcu_dereference_protected( ms->shared, lockdep_is_held( &ms->mutex ) );
+	if ( engine == MAILSLOT_ENGINE_SHARED && (ms->engine != engine || max_msg_size > old_shared->msg_size ||
+			__shared_cells( storage, old_shared->cell_size ) != old_shared->cells) ) {
+		shared = __shared_alloc( max_msg_size, storage );
+		if ( !shared ) {
+			kvfree( ring );
+			return -ENOMEM;
+		}
+	}
+
+	replace = ms->engine != engine || ring || shared;
+	old_ring = NULL;
+	old_shared = NULL;
+	error = SUCCESS;
+
+	__spsc_quiesce( ms );
+	__queue_lock_both( ms );
+
+	// msg_bytes also covers the room reserved by a splice in progress
+	if ( replace && (!__mailslot_empty( ms ) || atomic_long_read( &ms->msg_bytes ) || atomic_read( &ms->shared_maps ) > 0 ||
+			(ms->engine != engine && (ms->spsc || ms->sharded || ms->broadcast))) )
+		error = -EBUSY;
+	else if ( replace ) {
+
+		if ( engine != MAILSLOT_ENGINE_RING || ring ) {
+			old_ring = ms->ring;
+			ms->ring = ring;
+			ms->ring_size = ring ? ring_size : 0;
+			ms->ring_head = ms->ring_tail = 0;
+			ms->ring_taken = ms->ring_posted = 0;
+			ring = NULL;
+		}
+
+		if ( engine != MAILSLOT_ENGINE_SHARED || shared ) {
+			old_shared = rcu_dereference_protected( ms->shared, lockdep_is_held( &ms->mutex ) );
+			rcu_assign_pointer( ms->shared, shared );
+			shared = NULL;
+		}
+
+		WRITE_ONCE( ms->engine, engine );
+	}
+
+	if ( !error ) {
+		WRITE_ONCE( ms->max_msg_size, max_msg_size );
+		WRITE_ONCE( ms->storage, storage );
+	}
+
+	__queue_unlock_both( ms );
+	__spsc_resume( ms );
+
+	// Whatever is left over: the storage that was replaced, or the one that could not be installed
+	kvfree( ring );
+	kvfree( old_ring );
+	__shared_free( shared );
+	__shared_free( old_shared );
+
+	return error;
+
+}
+
+
+/* Bytes of the budget taken by a message of len bytes: a shared ring cell always takes its full size,
+   which follows from the maximum message size */
+static size_t __message_footprint( int engine, size_t len ) {
+
+	if ( engine == MAILSLOT_ENGINE_SHARED ) return SHARED_CELL_SIZE( len );
+
+	if ( engine == MAILSLOT_ENGINE_RING ) return RING_RECORD_SIZE( len );
+
+	return LIST_FOOTPRINT( len );
+
+}
+
+
+/* Allocate a list engine message and fill it with the whole content of the iterator. Called without the mailslot lock. */
+static struct message* __message_build( struct mailslot* ms, struct iov_iter* from, unsigned int priority, int non_blocking ) {
+
+	struct message* new_msg;
+	size_t len, bytes_left;
+
+	len = iov_iter_count( from );
+
+	new_msg = __message_alloc( len, len > MESSAGE_INLINE_MAX, non_blocking, __message_node( ms ) );
+	if ( !new_msg ) return ERR_PTR( non_blocking ? -EAGAIN : -ENOMEM );
+
+	new_msg->length = len;
+	new_msg->stamp = __enqueue_stamp();
+	new_msg->priority = priority;
+	
+	if ( non_blocking ) {
+		pagefault_disable();
+		bytes_left = __message_copy_in( new_msg, from );
+		pagefault_enable();
+	}
+	else bytes_left = __message_copy_in( new_msg, from );
+
+	if ( bytes_left > 0 ) {
+		debug_printk( KERN_WARNING "ERROR: CAN'T DELIVER THE MESSAGE TO MAILSLOT! SLOT N°: %d", ms->slot );
+		__message_free( new_msg );
+		return ERR_PTR( -EFAULT );
+	}
+	
+	debug_printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", new_msg->length );
+	debug_printk( KERN_INFO "MESSAGE CONTENT: %.*s", (int) len, new_msg->content );	// Not NUL-terminated
+
+	return new_msg;
+
+}
+
+
+static void __message_free( struct message* msg ) {
+
+	unsigned int i;
+
+	for ( i = 0; i < msg->nr_pages; i++ )
+		if ( msg->pages[i] ) put_page( msg->pages[i] );	// NULL once handed over to a pipe
+
+	kvfree( msg->pages );
+	kfree( msg->content );
+	kfree( msg );
+
+}
+
+
+/* Allocate a message able to hold len bytes, in pages if paged, on node (NUMA_NO_NODE for the local one). Not zeroed:
+   the payload is always fully written before it is read. A non-blocking caller does not dip into the atomic reserves
+   for the pages. */
+static struct message* __message_alloc( size_t len, int paged, int non_blocking, int node ) {
+
+	struct message* msg;
+	gfp_t gfp = non_blocking ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL;
+	unsigned int i;
+
+	msg = kzalloc_node( sizeof(struct message), non_blocking ? GFP_ATOMIC : GFP_KERNEL, node );
+	if ( !msg ) {
+		debug_printk( KERN_WARNING "ERROR: FAILED TO ALLOCATE MEMORY FOR THE MESSAGE STRUCT" );
+		return NULL;
+	}
+
+	if ( !paged ) {
+		msg->content = kmalloc_node( len, non_blocking ? GFP_ATOMIC : GFP_KERNEL, node );
+		if ( !msg->content ) goto fail;
+		return msg;
+	}
+
+	msg->pages = kvcalloc_node( DIV_ROUND_UP( len, PAGE_SIZE ), sizeof(struct page*), gfp, node );
+	if ( !msg->pages ) goto fail;
+
+	for ( i = 0; i < DIV_ROUND_UP( len, PAGE_SIZE ); i++ ) {
+		msg->pages[i] = alloc_pages_node( node, gfp, 0 );
+		if ( !msg->pages[i] ) goto fail;
+		msg->nr_pages++;
+	}
+
+	return msg;
+
+fail:
+	debug_printk( KERN_WARNING "ERROR: FAILED TO ALLOCATE MEMORY FOR THE MESSAGE CONTENT" );
+	__message_free( msg );
+	return NULL;
+
+}
+
+
+/* Give back the pages beyond the length of a paged message, allocated for a larger one */
+static void __message_trim( struct message* msg ) {
+
+	while ( msg->nr_pages > DIV_ROUND_UP( msg->length, PAGE_SIZE ) )
+		put_page( msg->pages[--msg->nr_pages] );
+
+}
+
+
+/* Fill the payload from the iterator. Returns the bytes that could not be copied, as copy_from_user(); the
+   iterator is only advanced on success. */
+static size_t __message_copy_in( struct message* msg, struct iov_iter* from ) {
+
+	size_t off, chunk, copied;
+
+	if ( !msg->pages ) copied = copy_from_iter( msg->content, msg->length, from );
+	else {
+		for ( off = 0, copied = 0; off < msg->length; off += chunk ) {
+			chunk = min_t( size_t, msg->length - off, PAGE_SIZE );
+			copied += copy_page_from_iter( msg->pages[off >> PAGE_SHIFT], 0, chunk, from );
+			if ( copied < off + chunk ) break;
+		}
+	}
+
+	if ( copied < msg->length ) iov_iter_revert( from, copied );
+
+	return msg->length - copied;
+
+}
+
+
+/* Copy the payload to the iterator, as selected by the MAILSLOT_READ_* flags: preceded by its length in drain
+   mode, cut to the room in the iterator in truncating mode. Returns the bytes that could not be copied, as
+   copy_to_user(); the iterator is only advanced on success. */
+static size_t __message_copy_out( struct message* msg, struct iov_iter* to, unsigned int mode ) {
+
+	size_t off, chunk, copied, frame_len, size;
+	u32 frame = msg->length;
+
+	frame_len = (mode & MAILSLOT_READ_DRAIN) ? FRAME_HEADER : 0;
+	size = (mode & MAILSLOT_READ_TRUNC) ? min( msg->length, iov_iter_count( to ) ) : msg->length;
+
+	copied = copy_to_iter( &frame, frame_len, to );
+
+	if ( copied == frame_len && !msg->pages ) copied += copy_to_iter( msg->content, size, to );
+	else if ( copied == frame_len ) {
+		for ( off = 0; off < size; off += chunk ) {
+			chunk = min_t( size_t, size - off, PAGE_SIZE );
+			copied += copy_page_to_iter( msg->pages[off >> PAGE_SHIFT], 0, chunk, to );
+			if ( copied < frame_len + off + chunk ) break;
+		}
+	}
+
+	if ( copied < frame_len + size ) {
+		iov_iter_revert( to, copied );
+		return frame_len + size - copied;
+	}
+
+	return 0;
+
+}
+
+
+/* Append a message to the FIFO of its lane. Called with the producer lock held. */
+static void __list_link( struct mailslot* ms, struct message* new_msg ) {
+
+	int lane = new_msg->priority;
+
+	new_msg->next = NULL;
+
+	smp_store_release( &ms->tail[lane]->next, new_msg );	// The message is complete before a consumer can reach it
+	ms->tail[lane] = new_msg;
+
+	atomic_long_add( LIST_FOOTPRINT( new_msg->length ), &ms->msg_bytes );
+
+	smp_mb__before_atomic();	// Linked before flagged: pairs with the barrier of __list_unlink()
+	set_bit( lane, &ms->lanes );
+
+	smp_mb__before_atomic();	// Flagged before counted: a consumer that sees the count finds the lane and the message
+	atomic_inc( &ms->msg_count );
+
+}
+
+
+/* Highest non-empty lane. Called with the consumer lock held, on a non-empty mailslot: a counted message has
+   its lane bit set (see __list_link()), and only the consumer clears the bit of a lane it has emptied. */
+static int __list_lane( struct mailslot* ms ) {
+
+	return __fls( READ_ONCE( ms->lanes ) );
+
+}
+
+
+/* Next message to be detached, left in place. Same context as __list_unlink(). */
+static struct message* __list_peek( struct mailslot* ms ) {
+
+	return smp_load_acquire( &ms->head[__list_lane( ms )]->next );
+
+}
+
+
+/* Detach the head of a non-empty lane, the highest one (__list_lane()) for the readers. Called with the consumer lock
+   held. The first message becomes the new dummy node: its content moves to the old dummy, which is returned. It stays
+   charged to msg_bytes until __list_release(): until then its room can't be taken and the engine can't change, so
+   __list_push_front() always has somewhere to put it back. */
+static struct message* __list_unlink( struct mailslot* ms, int lane ) {
+
+	struct message *msg = ms->head[lane], *first = smp_load_acquire( &ms->head[lane]->next );
+
+	msg->content = first->content;
+	msg->pages = first->pages;
+	msg->nr_pages = first->nr_pages;
+	msg->length = first->length;
+	msg->stamp = first->stamp;
+	msg->priority = lane;
+	msg->next = NULL;
+
+	first->content = NULL;
+	first->pages = NULL;
+	first->nr_pages = 0;
+	ms->head[lane] = first;
+
+	// Emptied lane: its bit is cleared, unless a producer linked a message meanwhile. Either this check sees the
+	// message, or the producer sets the bit again after the clear.
+	if ( !READ_ONCE( first->next ) ) {
+		clear_bit( lane, &ms->lanes );
+		smp_mb__after_atomic();
+		if ( READ_ONCE( first->next ) ) set_bit( lane, &ms->lanes );
+	}
+
+	atomic_dec( &ms->msg_count );
+
+	return msg;
+
+}
+
+
+/* Put back a chain of detached messages that could not be delivered, ahead of the others of their lane and in their
+   original order. Takes both queue locks: the tail of a lane moves as well if its FIFO is empty. */
+static void __list_push_front( struct mailslot* ms, struct message* chain ) {
+
+	struct message *first[MAILSLOT_PRIORITIES] = { NULL }, *last[MAILSLOT_PRIORITIES];
+	struct message *msg, *next;
+	int n, lane;
+
+	for ( n = 0, msg = chain; msg; msg = next, n++ ) {
+		next = msg->next;
+		lane = msg->priority;
+		msg->next = NULL;
+		if ( first[lane] ) last[lane]->next = msg;
+		else first[lane] = msg;
+		last[lane] = msg;
+	}
+
+	__queue_lock_both( ms );
+
+	for ( lane = 0; lane < MAILSLOT_PRIORITIES; lane++ ) {
+
+		if ( !first[lane] ) continue;
+
+		last[lane]->next = ms->head[lane]->next;
+		if ( !last[lane]->next ) ms->tail[lane] = last[lane];
+
+		smp_store_release( &ms->head[lane]->next, first[lane] );
+		set_bit( lane, &ms->lanes );
+	}
+
+	smp_mb__before_atomic();	// Still charged to msg_bytes (see __list_unlink()): only counted again
+	atomic_add( n, &ms->msg_count );
+
+	__queue_unlock_both( ms );
+
+	__wake_readers( ms, n );
+
+}
+
+
+/* A detached message delivered to the reader: its room goes back to the writers, and only now is it counted as read */
+static void __list_release( struct mailslot* ms, struct message* msg ) {
+
+	atomic_long_sub( LIST_FOOTPRINT( msg->length ), &ms->msg_bytes );
+
+	__account_dequeue( ms, msg->length, msg->stamp );
+	__account_numa( ms, msg );
+
+}
+
+
+static void __message_free_chain( struct message* chain ) {
+
+	struct message* next;
+
+	for ( ; chain; chain = next ) {
+		next = chain->next;
+		__message_free( chain );
+	}
+
+}
+
+
+/* Copy the ring head out as __message_copy_out() does, and release it. Called with the mailslot lock held, on a
+   non-empty mailslot: page faults are disabled, so -EFAULT may just mean that the buffer must be faulted in. The
+   iterator is only advanced on success. Returns the whole length of the message, even if truncated. */
+static ssize_t __ring_dequeue( struct mailslot* ms, struct iov_iter* to, unsigned int mode, u64* stamp ) {
+
+	struct ring_header* header;
+	size_t mask = ms->ring_size - 1;
+	size_t off, first, copied, msg_len, frame_len, size;
+	u32 frame;
+
+	off = ms->ring_head & mask;
+	header = (struct ring_header*) (ms->ring + off);
+	msg_len = header->length;
+	*stamp = header->stamp;
+	frame = msg_len;
+	frame_len = (mode & MAILSLOT_READ_DRAIN) ? FRAME_HEADER : 0;
+
+	if ( frame_len + msg_len > iov_iter_count( to ) && !(mode & MAILSLOT_READ_TRUNC) ) {
+		debug_printk( KERN_WARNING "ERROR: CAN'T READ. BUFFER TOO LITTLE!" );
+		return -EMSGSIZE;
+	}
+
+	size = min( msg_len, iov_iter_count( to ) - frame_len );
+
+	// The payload may wrap around the end of the ring: copy it in (at most) two chunks
+	off = (off + sizeof(struct ring_header)) & mask;
+	first = min( size, ms->ring_size - off );
+
+	pagefault_disable();
+	copied = copy_to_iter( &frame, frame_len, to );
+	if ( copied == frame_len )
+		copied += copy_to_iter( ms->ring + off, first, to );
+	if ( copied == frame_len + first && first < size )
+		copied += copy_to_iter( ms->ring, size - first, to );
+	pagefault_enable();
+
+	if ( copied < frame_len + size ) {
+		iov_iter_revert( to, copied );
+		debug_printk( KERN_WARNING "ERROR: CAN'T GET THE MESSAGE FROM MAILSLOT! SLOT N°: %d", ms->slot );
+		return -EFAULT;
+	}
+
+	debug_printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", msg_len );
+
+	WRITE_ONCE( ms->ring_taken, ms->ring_taken + 1 );
+	smp_store_release( &ms->ring_head, ms->ring_head + RING_RECORD_SIZE( msg_len ) );	// The record may now be overwritten
+
+	return msg_len;
+
+}
+
+
+/* Append a record with the whole content of the iterator. Called with the mailslot lock held, on a mailslot
+   with enough room: page faults are disabled, so -EFAULT may just mean that the buffer must be faulted in. */
+static int __ring_enqueue( struct mailslot* ms, struct iov_iter* from ) {
+
+	struct ring_header* header;
+	size_t mask = ms->ring_size - 1;
+	size_t off, first, copied, len;
+
+	len = iov_iter_count( from );
+	off = ms->ring_tail & mask;
+	header = (struct ring_header*) (ms->ring + off);
+	header->length = len;
+	header->stamp = __enqueue_stamp();
+
+	off = (off + sizeof(struct ring_header)) & mask;
+	first = min( len, ms->ring_size - off );
+
+	pagefault_disable();
+	copied = copy_from_iter( ms->ring + off, first, from );
+	if ( copied == first && first < len )
+		copied += copy_from_iter( ms->ring, len - first, from );
+	pagefault_enable();
+
+	// The tail is not moved on failure, so a partially copied record never becomes visible
+	if ( copied < len ) {
+		iov_iter_revert( from, copied );
+		debug_printk( KERN_WARNING "ERROR: CAN'T DELIVER THE MESSAGE TO MAILSLOT! SLOT N°: %d", ms->slot );
+		return -EFAULT;
+	}
+
+	debug_printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", len );
+
+	WRITE_ONCE( ms->ring_posted, ms->ring_posted + 1 );
+	smp_store_release( &ms->ring_tail, ms->ring_tail + RING_RECORD_SIZE( len ) );	// The record is complete
+
+	return SUCCESS;
+
+}
+
+
+/* Ring emptiness and fullness without the lock: the acquire on the other side's offset makes its
+   record (or its copy out of the ring) visible before the offset is trusted */
+static int __ring_empty( struct mailslot* ms ) {
+
+	return smp_load_acquire( &ms->ring_tail ) == READ_ONCE( ms->ring_head );
+
+}
+
+
+static int __ring_full( struct mailslot* ms, size_t len ) {
+
+	size_t head = smp_load_acquire( &ms->ring_head );
+
+	// The ring is at least as large as the budget, so the budget is the only bound
+	return READ_ONCE( ms->ring_tail ) - head + RING_RECORD_SIZE( len ) > READ_ONCE( ms->storage );
+
+}
+
+
+/* Overwrite policy: release the ring head unread. Called with both queue locks held, on a non-empty ring. */
+static void __ring_evict( struct mailslot* ms ) {
+
+	struct ring_header* header = (struct ring_header*) (ms->ring + (ms->ring_head & (ms->ring_size - 1)));
+
+	WRITE_ONCE( ms->ring_taken, ms->ring_taken + 1 );
+	smp_store_release( &ms->ring_head, ms->ring_head + RING_RECORD_SIZE( header->length ) );
+
+}
+
+
+/* Lockless paths: the SPSC mode of the ring engine and the sharded mode of the list engine. They return -EOPNOTSUPP
+   when neither is on, for the caller to take the locked path. */
+static ssize_t __lockless_read( struct mailslot* ms, struct iov_iter* to, unsigned int mode, int non_blocking, int wait, unsigned int busy_poll ) {
+
+	if ( READ_ONCE( ms->sharded ) ) return __sharded_read( ms, to, mode, non_blocking, wait, busy_poll );
+
+	return __spsc_read( ms, to, mode, non_blocking, wait, busy_poll );
+
+}
+
+
+static ssize_t __lockless_write( struct mailslot* ms, struct iov_iter* from, int non_blocking, int wait ) {
+
+	if ( READ_ONCE( ms->sharded ) ) return __sharded_write( ms, from, non_blocking, wait );
+
+	return __spsc_write( ms, from, non_blocking, wait );
+
+}
+
+
+/* SPSC mode read: the ring head is consumed without the mailslot lock. The consumer bit turns a second
+   concurrent reader, which breaks the single-consumer contract, into -EBUSY instead of a corrupted ring.
+   Returns -EOPNOTSUPP when the mode is off or being reconfigured, for the caller to take the locked path. */
+static ssize_t __spsc_read( struct mailslot* ms, struct iov_iter* to, unsigned int mode, int non_blocking, int wait, unsigned int busy_poll ) {
+
+	ssize_t msg_len;
+	u64 stamp, blocked;
+	int interrupted;
+
+retry:
+	if ( test_and_set_bit_lock( SPSC_CONSUMER, &ms->spsc_busy ) ) {
+		if ( test_bit( SPSC_CONFIG, &ms->spsc_busy ) ) return -EOPNOTSUPP;
+		debug_printk( KERN_WARNING "ERROR: CONCURRENT READERS ON A SINGLE-CONSUMER MAILSLOT! SLOT N°: %d", ms->slot );
+		return -EBUSY;
+	}
+
+	if ( !READ_ONCE( ms->spsc ) || test_bit( SPSC_CONFIG, &ms->spsc_busy ) ) msg_len = -EOPNOTSUPP;
+	else if ( __ring_empty( ms ) ) msg_len = -EAGAIN;
+	else msg_len = __ring_dequeue( ms, to, mode, &stamp );
+
+	clear_bit_unlock( SPSC_CONSUMER, &ms->spsc_busy );
+
+	if ( msg_len >= 0 ) {
+		__account_dequeue( ms, msg_len, stamp );
+		__wake_writers( ms, 1 );
+		return msg_len;
+	}
+
+	if ( msg_len == -EFAULT && !non_blocking ) {
+		if ( fault_in_iov_iter_writeable( to, min( iov_iter_count( to ), FRAME_HEADER + READ_ONCE( ms->max_msg_size ) ) ) ) return -EFAULT;
+		goto retry;
+	}
+
+	if ( msg_len != -EAGAIN || !wait ) return msg_len;
+
+	if ( busy_poll && __busy_poll( ms, busy_poll ) ) goto retry;
+
+	trace_mailslot_block( ms->slot, MAILSLOT_TRACE_READ );
+	blocked = ktime_get_ns();
+	interrupted = wait_event_interruptible_exclusive( ms->read_queue, !__ring_empty( ms ) || !READ_ONCE( ms->spsc ) );
+	__account_wake( ms, MAILSLOT_TRACE_READ, blocked );
+	if ( interrupted ) return -EINTR;
+
+	goto retry;
+
+}
+
+
+/* SPSC mode write: the counterpart of __spsc_read() for the single producer */
+static ssize_t __spsc_write( struct mailslot* ms, struct iov_iter* from, int non_blocking, int wait ) {
+
+	size_t len = iov_iter_count( from );
+	u64 blocked;
+	int error, interrupted;
+
+retry:
+	if ( test_and_set_bit_lock( SPSC_PRODUCER, &ms->spsc_busy ) ) {
+		if ( test_bit( SPSC_CONFIG, &ms->spsc_busy ) ) return -EOPNOTSUPP;
+		debug_printk( KERN_WARNING "ERROR: CONCURRENT WRITERS ON A SINGLE-PRODUCER MAILSLOT! SLOT N°: %d", ms->slot );
+		return -EBUSY;
+	}
+
+	if ( !READ_ONCE( ms->spsc ) || test_bit( SPSC_CONFIG, &ms->spsc_busy ) ) error = -EOPNOTSUPP;
+	else if ( len > ms->max_msg_size ) error = -EPERM;	// Only changed while quiesced
+	else if ( __ring_full( ms, len ) ) error = -EAGAIN;
+	else error = __ring_enqueue( ms, from );
+
+	clear_bit_unlock( SPSC_PRODUCER, &ms->spsc_busy );
+
+	if ( error == SUCCESS ) {
+		__account_enqueue( ms, len );
+		trace_mailslot_enqueue( ms->slot, len, __mailslot_depth( ms ) );
+		__wake_readers( ms, 1 );
+		return len;
+	}
+
+	if ( error == -EFAULT && !non_blocking ) {
+		if ( fault_in_iov_iter_readable( from, len ) ) return -EFAULT;
+		goto retry;
+	}
+
+	if ( error != -EAGAIN || !wait ) return error;
+
+	trace_mailslot_block( ms->slot, MAILSLOT_TRACE_WRITE );
+	blocked = ktime_get_ns();
+	interrupted = wait_event_interruptible_exclusive( ms->write_queue, !__ring_full( ms, len ) || !READ_ONCE( ms->spsc ) );
+	__account_wake( ms, MAILSLOT_TRACE_WRITE, blocked );
+	if ( interrupted ) return -EINTR;
+
+	goto retry;
+
+}
+
+
+/* Send new lockless operations to the locked path, which blocks on the mailslot lock held by the caller,
+   and wait for those in progress: they hold their bit for one bounded copy, with page faults disabled. */
+static void __spsc_quiesce( struct mailslot* ms ) {
+
+	if ( !ms->spsc ) return;
+
+	set_bit( SPSC_CONFIG, &ms->spsc_busy );
+
+	while ( cmpxchg( &ms->spsc_busy, BIT( SPSC_CONFIG ), SPSC_QUIESCED ) != BIT( SPSC_CONFIG ) )
+		cond_resched();
+
+}
+
+
+static void __spsc_resume( struct mailslot* ms ) {
+
+	if ( ms->spsc ) smp_store_release( &ms->spsc_busy, 0 );
+
+}
+
+
+/* The ring and shared engines store messages in place: copies are done under the lock, with page faults disabled */
+static ssize_t __inplace_dequeue( struct mailslot* ms, struct iov_iter* to, unsigned int mode, u64* stamp ) {
+
+	if ( ms->engine == MAILSLOT_ENGINE_SHARED ) return __shared_dequeue( ms, to, mode, stamp );
+
+	return __ring_dequeue( ms, to, mode, stamp );
+
+}
+
+
+static int __inplace_enqueue( struct mailslot* ms, struct iov_iter* from ) {
+
+	if ( ms->engine == MAILSLOT_ENGINE_SHARED ) return __shared_enqueue( ms, from );
+
+	return __ring_enqueue( ms, from );
+
+}
+
+
+/* Positions are always masked with the kernel copy of the geometry, never with the one in the header */
+static struct mailslot_shared_cell* __shared_cell( struct shared_ring* ring, u64 pos ) {
+
+	return (struct mailslot_shared_cell*) ((char*) ring->header + PAGE_SIZE + (pos & (ring->cells - 1)) * ring->cell_size);
+
+}
+
+
+/* Consume the next message of the shared ring. Called with the mailslot lock held, which only serializes the
+   kernel users: userspace consumers may race with it, in which case -EAGAIN is returned once the ring looks
+   empty again. The copy is done before claiming the cell and is only valid if the claim succeeds: otherwise
+   the iterator is reverted. The MAILSLOT_READ_* flags apply as in __ring_dequeue(). */
+static ssize_t __shared_dequeue( struct mailslot* ms, struct iov_iter* to, unsigned int mode, u64* stamp ) {
+
+	struct shared_ring* ring;
+	struct mailslot_shared_cell* cell;
+	size_t msg_len, copied, frame_len, size;
+	u32 frame;
+	u64 pos, seq;
+	int attempts;
+
+	ring = rcu_dereference_protected( ms->shared, lockdep_is_held( &ms->consumer_lock ) );
+
+	for ( attempts = 0; attempts < SHARED_ATTEMPTS; attempts++ ) {
+
+		pos = READ_ONCE( ring->header->consumer );
+		cell = __shared_cell( ring, pos );
+		seq = smp_load_acquire( &cell->sequence );
+
+		if ( (s64) (seq - (pos + 1)) < 0 ) return -EAGAIN;	// Empty
+		if ( seq != pos + 1 ) continue;	// Somebody else consumed it meanwhile
+
+		msg_len = READ_ONCE( cell->length );
+		if ( msg_len > ring->msg_size ) msg_len = 0;	// Garbage written by userspace: skipped as an empty cell
+
+		frame = msg_len;
+		frame_len = (mode & MAILSLOT_READ_DRAIN) && msg_len > 0 ? FRAME_HEADER : 0;	// An empty cell delivers nothing, not even its length
+
+		if ( frame_len + msg_len > iov_iter_count( to ) && !(mode & MAILSLOT_READ_TRUNC) ) {
+			if ( READ_ONCE( ring->header->consumer ) != pos ) continue;
+			debug_printk( KERN_WARNING "ERROR: CAN'T READ. BUFFER TOO LITTLE!" );
+			return -EMSGSIZE;
+		}
+
+		size = min( msg_len, iov_iter_count( to ) - frame_len );
+
+		pagefault_disable();
+		copied = copy_to_iter( &frame, frame_len, to );
+		if ( copied == frame_len )
+			copied += copy_to_iter( cell + 1, size, to );
+		pagefault_enable();
+
+		if ( copied < frame_len + size ) {
+			iov_iter_revert( to, copied );
+			debug_printk( KERN_WARNING "ERROR: CAN'T GET THE MESSAGE FROM MAILSLOT! SLOT N°: %d", ms->slot );
+			return -EFAULT;
+		}
+
+		*stamp = READ_ONCE( cell->stamp );
+
+		if ( cmpxchg64( &ring->header->consumer, pos, pos + 1 ) != pos ) {
+			iov_iter_revert( to, copied );
+			continue;
+		}
+
+		smp_store_release( &cell->sequence, pos + ring->cells );	// Hand the cell back to the producers
+
+		if ( msg_len == 0 ) continue;	// Nothing to deliver: go on with the next cell
+
+		debug_printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", msg_len );
+
+		return msg_len;
+	}
+
+	return -EAGAIN;
+
+}
+
+
+/* Publish a message on the shared ring. Called with the mailslot lock held: as for __shared_dequeue(),
+   userspace producers may race with it and -EAGAIN is returned if they fill the ring first. A claimed cell
+   must be published in any case: if the copy faults, it is published empty and -EFAULT is returned. */
+static int __shared_enqueue( struct mailslot* ms, struct iov_iter* from ) {
+
+	struct shared_ring* ring;
+	struct mailslot_shared_cell* cell;
+	size_t copied, len;
+	u64 pos, seq;
+	int attempts;
+
+	ring = rcu_dereference_protected( ms->shared, lockdep_is_held( &ms->producer_lock ) );
+	len = iov_iter_count( from );
+
+	if ( len > ring->msg_size ) return -EPERM;
+
+	for ( attempts = 0; attempts < SHARED_ATTEMPTS; attempts++ ) {
+
+		pos = READ_ONCE( ring->header->producer );
+		cell = __shared_cell( ring, pos );
+		seq = smp_load_acquire( &cell->sequence );
+
+		if ( (s64) (seq - pos) < 0 ) return -EAGAIN;	// Full
+		if ( seq != pos ) continue;	// Somebody else claimed it meanwhile
+
+		if ( cmpxchg64( &ring->header->producer, pos, pos + 1 ) == pos ) break;
+	}
+
+	if ( attempts == SHARED_ATTEMPTS ) return -EAGAIN;
+
+	pagefault_disable();
+	copied = copy_from_iter( cell + 1, len, from );
+	pagefault_enable();
+
+	WRITE_ONCE( cell->length, copied < len ? 0 : len );
+	WRITE_ONCE( cell->stamp, __enqueue_stamp() );
+	smp_store_release( &cell->sequence, pos + 1 );
+
+	if ( copied < len ) {
+		iov_iter_revert( from, copied );
+		debug_printk( KERN_WARNING "ERROR: CAN'T DELIVER THE MESSAGE TO MAILSLOT! SLOT N°: %d", ms->slot );
+		return -EFAULT;
+	}
+
+	debug_printk( KERN_INFO "MESSAGE LENGTH:  %zu BYTES", len );
+
+	return SUCCESS;
+
+}
+
+
+/* Lockless emptiness and fullness of the shared ring: also used by the wait conditions and poll(). A cell is only
+   ready with the exact sequence __shared_dequeue() and __shared_enqueue() expect: any other one, unless the index
+   moved meanwhile, is garbage left by userspace and must put the waiters to sleep rather than send them spinning. */
+static int __shared_empty( struct mailslot* ms ) {
+
+	struct shared_ring* ring;
+	u64 pos, seq;
+	int attempts, empty = 1;
+
+	rcu_read_lock();
+	ring = rcu_dereference( ms->shared );
+	if ( ring ) {
+		attempts = 0;
+		do {
+			pos = READ_ONCE( ring->header->consumer );
+			seq = smp_load_acquire( &__shared_cell( ring, pos )->sequence );
+		} while ( seq != pos + 1 && READ_ONCE( ring->header->consumer ) != pos && ++attempts < SHARED_ATTEMPTS );
+		empty = seq != pos + 1;
+	}
+	rcu_read_unlock();
+
+	return empty;
+
+}
+
+
+static int __shared_full( struct mailslot* ms ) {
+
+	struct shared_ring* ring;
+	u64 pos, seq;
+	int attempts, full = 1;
+
+	rcu_read_lock();
+	ring = rcu_dereference( ms->shared );
+	if ( ring ) {
+		attempts = 0;
+		do {
+			pos = READ_ONCE( ring->header->producer );
+			seq = smp_load_acquire( &__shared_cell( ring, pos )->sequence );
+		} while ( seq != pos && READ_ONCE( ring->header->producer ) != pos && ++attempts < SHARED_ATTEMPTS );
+		full = seq != pos;
+	}
+	rcu_read_unlock();
+
+	return full;
+
+}
+
+
+/* A kernel operation on the shared ring lost to userspace, racing or misbehaving, is retried by the blocking callers:
+   never without letting them be interrupted, nor hogging the CPU */
+static int __shared_backoff( void ) {
+
+	if ( signal_pending( current ) ) return -EINTR;
+
+	cond_resched();
+
+	return SUCCESS;
+
+}
+
+
+/* Raise the waiter flag of a shared ring before looking at it: a userspace peer that publishes afterwards
+   sees the flag and calls MAILSLOT_NOTIFY, one that published before is seen by the caller */
+static void __shared_arm( struct mailslot* ms, int op ) {
+
+	struct shared_ring* ring;
+	u32* waiters;
+
+	rcu_read_lock();
+	ring = rcu_dereference( ms->shared );
+	if ( ring ) {
+		waiters = op == MAILSLOT_TRACE_READ ? &ring->header->read_waiters : &ring->header->write_waiters;
+		if ( !READ_ONCE( *waiters ) ) WRITE_ONCE( *waiters, 1 );
+	}
+	rcu_read_unlock();
+
+	smp_mb();
+
+}
+
+
+/* MAILSLOT_NOTIFY: wake the sleepers after userspace changed the shared ring. The waiter flags are dropped
+   first and raised again for the queues that still have entries, so a flag is never left down under a sleeper. */
+static void __shared_notify( struct mailslot* ms ) {
+
+	struct shared_ring* ring;
+
+	rcu_read_lock();
+	ring = rcu_dereference( ms->shared );
+	if ( ring ) {
+		WRITE_ONCE( ring->header->read_waiters, 0 );
+		WRITE_ONCE( ring->header->write_waiters, 0 );
+		smp_mb();
+		if ( waitqueue_active( &ms->read_queue ) ) WRITE_ONCE( ring->header->read_waiters, 1 );
+		if ( waitqueue_active( &ms->write_queue ) ) WRITE_ONCE( ring->header->write_waiters, 1 );
+	}
+	rcu_read_unlock();
+
+	wake_up_interruptible_poll( &ms->read_queue, EPOLLIN | EPOLLRDNORM );
+	wake_up_interruptible_poll( &ms->write_queue, EPOLLOUT | EPOLLWRNORM );
+
+}
+
+
+/* Allocate a shared ring whose cells hold max_msg_size bytes, as many as the budget allows */
+static struct shared_ring* __shared_alloc( size_t max_msg_size, size_t storage ) {
+
+	struct shared_ring* ring;
+	struct mailslot_shared_header* header;
+	u32 i;
+
+	BUILD_BUG_ON( sizeof(struct mailslot_shared_header) > PAGE_SIZE );
+
+	ring = kzalloc( sizeof(struct shared_ring), GFP_KERNEL );
+	if ( !ring ) return NULL;
+
+	ring->cell_size = SHARED_CELL_SIZE( max_msg_size );
+	ring->cells = __shared_cells( storage, ring->cell_size );
+	ring->msg_size = ring->cell_size - sizeof(struct mailslot_shared_cell);
+	ring->size = PAGE_SIZE + PAGE_ALIGN( (size_t) ring->cells * ring->cell_size );
+
+	header = vmalloc_user( ring->size );	// Zeroed, and mappable with remap_vmalloc_range()
+	if ( !header ) {
+		kfree( ring );
+		return NULL;
+	}
+
+	header->magic = MAILSLOT_SHARED_MAGIC;
+	header->cell_size = ring->cell_size;
+	header->cell_count = ring->cells;
+	header->data_offset = PAGE_SIZE;
+	header->max_msg_size = ring->msg_size;
+	ring->header = header;
+
+	for ( i = 0; i < ring->cells; i++ )
+		__shared_cell( ring, i )->sequence = i;
+
+	return ring;
+
+}
+
+
+/* Cells of cell_size bytes fitting a budget: a power of two, at least one */
+static u32 __shared_cells( size_t storage, u32 cell_size ) {
+
+	return rounddown_pow_of_two( max_t( size_t, storage / cell_size, 1 ) );
+
+}
+
+
+/* Free a shared ring that is no longer reachable from its mailslot, nor mapped */
+static void __shared_free( struct shared_ring* ring ) {
+
+	if ( !ring ) return;
+
+	synchronize_rcu();	// Lockless wait conditions and poll() may still be looking at it
+
+	vfree( ring->header );
+	kfree( ring );
+
+}
+
+
+static void __shared_vma_open( struct vm_area_struct* vma ) {
+
+	atomic_inc( &((struct mailslot*) vma->vm_private_data)->shared_maps );
+
+}
+
+
+static void __shared_vma_close( struct vm_area_struct* vma ) {
+
+	atomic_dec( &((struct mailslot*) vma->vm_private_data)->shared_maps );
+
+}
+
+
+/* Every message is stamped: the residency histograms are always on */
+static u64 __enqueue_stamp( void ) {
+
+	return ktime_get_ns();
+
+}
+
+
+/* Turn the broadcast mode on or off, or switch between blocking and dropping. Called with the mailslot lock held.
+   Turning it on or off needs an empty list engine mailslot; turning it off also ends the subscriptions. */
+static int __broadcast_configure( struct mailslot* ms, int mode ) {
+
+	struct message** bcast;
+	struct session *session, *tmp;
+	int error = SUCCESS;
+
+	if ( mode != MAILSLOT_BROADCAST_OFF && (ms->engine != MAILSLOT_ENGINE_LIST || ms->overflow || ms->sharded) ) {
+		debug_printk( KERN_WARNING "ERROR: THE BROADCAST MODE NEEDS THE LIST ENGINE, WITHOUT THE OVERWRITE POLICY AND THE SHARDS! SLOT N°: %d", ms->slot );
+		return -EINVAL;
+	}
+
+	// The retention ring is allocated on the first use and kept: lockless readers never see it go away
+	if ( mode != MAILSLOT_BROADCAST_OFF && !ms->bcast ) {
+		bcast = kcalloc_node( MAILSLOT_BROADCAST_DEPTH, sizeof(struct message*), GFP_KERNEL, __message_node( ms ) );
+		if ( !bcast ) return -ENOMEM;
+		ms->bcast = bcast;
+	}
+
+	__queue_lock_both( ms );	// Locked operations check the mode under their queue lock
+
+	// msg_bytes covers both the queued messages and the retained ones (and the room reserved by a splice)
+	if ( !ms->broadcast != !mode && atomic_long_read( &ms->msg_bytes ) ) error = -EBUSY;
+	else {
+		if ( mode == MAILSLOT_BROADCAST_OFF ) {
+			list_for_each_entry_safe( session, tmp, &ms->subscribers, subscriber ) list_del_init( &session->subscriber );
+			ms->nr_subscribers = 0;
+		}
+		WRITE_ONCE( ms->broadcast, mode );
+	}
+
+	__queue_unlock_both( ms );
+
+	// Sleepers of either path wait on conditions of the other mode: let them all look again
+	wake_up_interruptible_all( &ms->read_queue );
+	wake_up_interruptible_all( &ms->write_queue );
+
+	return error;
+
+}
+
+
+/* Subscribe a session to the broadcast messages written from now on, or unsubscribe it */
+static int __broadcast_subscribe( struct mailslot* ms, struct session* session, int on ) {
+
+	struct message* dead = NULL;
+	int error = SUCCESS;
+
+	__producer_lock( ms );
+
+	if ( !ms->broadcast ) error = -EINVAL;
+	else if ( on && list_empty( &session->subscriber ) ) {
+		WRITE_ONCE( session->cursor, ms->bcast_tail );
+		list_add_tail( &session->subscriber, &ms->subscribers );
+		ms->nr_subscribers++;
+	}
+	else if ( !on && !list_empty( &session->subscriber ) ) __broadcast_unsubscribe( ms, session, &dead );
+
+	__producer_unlock( ms );
+
+	if ( !on ) __wake_readers( ms, 0 );	// A reader of the session may be waiting for its next message
+
+	if ( dead ) {
+		__message_free_chain( dead );
+		__wake_writers( ms, 1 );
+	}
+
+	return error;
+
+}
+
+
+/* Remove a subscriber, releasing the messages it has not read. Called with the producer lock held; the messages
+   released for good are chained to *dead, to be freed after the unlock. */
+static void __broadcast_unsubscribe( struct mailslot* ms, struct session* session, struct message** dead ) {
+
+	u64 seq;
+
+	for ( seq = session->cursor; seq != ms->bcast_tail; seq++ ) __broadcast_put( ms, seq, dead );
+
+	list_del_init( &session->subscriber );
+	ms->nr_subscribers--;
+
+}
+
+
+/* Drop a reference to the retained message of sequence number seq. Called with the producer lock held. */
+static void __broadcast_put( struct mailslot* ms, u64 seq, struct message** dead ) {
+
+	struct message* msg = ms->bcast[BROADCAST_SLOT( seq )];
+
+	if ( --msg->readers ) return;
+
+	ms->bcast[BROADCAST_SLOT( seq )] = NULL;
+	atomic_long_sub( LIST_FOOTPRINT( msg->length ), &ms->msg_bytes );
+	msg->next = *dead;
+	*dead = msg;
+
+	// Messages are mostly released in order, but a reader copying one keeps it a little longer
+	while ( ms->bcast_head != ms->bcast_tail && !ms->bcast[BROADCAST_SLOT( ms->bcast_head )] )
+		WRITE_ONCE( ms->bcast_head, ms->bcast_head + 1 );
+
+}
+
+
+/* Drop mode: unsubscribe the subscribers that hold the oldest message back, until a message of len bytes fits.
+   Called with the producer lock held. A message that a reader is still copying can't be released: the room may
+   be missing even so. */
+static void __broadcast_drop( struct mailslot* ms, size_t len, struct message** dead ) {
+
+	struct session *session, *tmp;
+	u64 head;
+
+	while ( !__broadcast_room( ms, len ) && ms->bcast_head != ms->bcast_tail ) {
+
+		head = ms->bcast_head;
+
+		list_for_each_entry_safe( session, tmp, &ms->subscribers, subscriber ) {
+			if ( session->cursor == head ) {
+				debug_printk( KERN_INFO "DROPPING A SLOW SUBSCRIBER! SLOT N°: %d", ms->slot );
+				__broadcast_unsubscribe( ms, session, dead );
+			}
+		}
+
+		if ( ms->bcast_head == head ) break;
+	}
+
+}
+
+
+/* Broadcast mode: a message of len bytes fits the byte budget and the retention ring. Read locklessly by the wait
+   conditions and poll() as well. */
+static int __broadcast_room( struct mailslot* ms, size_t len ) {
+
+	return READ_ONCE( ms->bcast_tail ) - READ_ONCE( ms->bcast_head ) < MAILSLOT_BROADCAST_DEPTH &&
+		atomic_long_read( &ms->msg_bytes ) + LIST_FOOTPRINT( len ) <= READ_ONCE( ms->storage );
+
+}
+
+
+/* A broadcast read of the session would not wait: it has a message to read, or it fails */
+static int __broadcast_readable( struct mailslot* ms, struct session* session ) {
+
+	return !READ_ONCE( ms->broadcast ) || list_empty_careful( &session->subscriber ) ||
+		READ_ONCE( session->cursor ) != smp_load_acquire( &ms->bcast_tail );
+
+}
+
+
+/* MAILSLOT_GET_INFO in broadcast mode: the messages the session has not read yet */
+static void __broadcast_info( struct mailslot* ms, struct session* session, struct mailslot_info* info ) {
+
+	info->next_size = MAILSLOT_NO_MESSAGE;
+	info->msg_count = 0;
+
+	__producer_lock( ms );
+
+	if ( ms->broadcast && !list_empty( &session->subscriber ) && session->cursor != ms->bcast_tail ) {
+		info->next_size = ms->bcast[BROADCAST_SLOT( session->cursor )]->length;
+		info->msg_count = ms->bcast_tail - session->cursor;
+	}
+
+	__producer_unlock( ms );
+
+}
+
+
+/* Broadcast mode read: the next message of the subscriber. It is copied out without the lock, under a reference of
+   its own that keeps the message alive even if the subscriber is dropped meanwhile. Returns -EOPNOTSUPP if the mode
+   is off, for the caller to take the regular path. */
+static ssize_t __broadcast_read( struct mailslot* ms, struct session* session, struct iov_iter* to, unsigned int mode, int non_blocking ) {
+
+	struct message *msg, *dead = NULL;
+	ssize_t msg_len;
+	size_t bytes_left;
+	u64 seq, stamp, blocked;
+	int interrupted;
+
+	if ( mode & MAILSLOT_READ_DRAIN ) {
+		debug_printk( KERN_WARNING "ERROR: THE DRAIN MODE CAN'T READ A BROADCAST MAILSLOT!" );
+		return -EINVAL;
+	}
+
+retry:
+	// The reads of a file share its cursor: one at a time, but never held while sleeping
+	if ( non_blocking ) {
+		if ( !mutex_trylock( &session->read_mutex ) ) return -EAGAIN;
+	}
+	else if ( mutex_lock_interruptible( &session->read_mutex ) ) return -EINTR;
+
+	__producer_lock( ms );
+
+	msg = NULL;
+	if ( !ms->broadcast ) msg_len = -EOPNOTSUPP;
+	else if ( list_empty( &session->subscriber ) ) msg_len = -EPIPE;	// Never subscribed, or dropped to make room
+	else if ( session->cursor == ms->bcast_tail ) msg_len = -EAGAIN;
+	else {
+		seq = session->cursor;
+		msg = ms->bcast[BROADCAST_SLOT( seq )];
+		msg_len = msg->length;
+		stamp = msg->stamp;
+		if ( msg->length > iov_iter_count( to ) && !(mode & MAILSLOT_READ_TRUNC) ) {
+			debug_printk( KERN_WARNING "ERROR: CAN'T READ. BUFFER TOO LITTLE!" );
+			msg_len = -EMSGSIZE;
+			msg = NULL;
+		}
+		else msg->readers++;
+	}
+
+	__producer_unlock( ms );
+
+	if ( !msg ) {
+
+		mutex_unlock( &session->read_mutex );
+
+		if ( msg_len != -EAGAIN || non_blocking ) return msg_len;
+
+		trace_mailslot_block( ms->slot, MAILSLOT_TRACE_READ );
+		blocked = ktime_get_ns();
+		interrupted = wait_event_interruptible( ms->read_queue, __broadcast_readable( ms, session ) );	// Every subscriber is woken
+		__account_wake( ms, MAILSLOT_TRACE_READ, blocked );
+		if ( interrupted ) return -EINTR;
+		goto retry;
+	}
+
+	if ( non_blocking ) {
+		pagefault_disable();
+		bytes_left = __message_copy_out( msg, to, mode );
+		pagefault_enable();
+	}
+	else bytes_left = __message_copy_out( msg, to, mode );
+
+	__producer_lock( ms );
+
+	// Delivered: the reference of the subscriber goes with its cursor, unless it was dropped meanwhile
+	if ( bytes_left == 0 && !list_empty( &session->subscriber ) && session->cursor == seq ) {
+		WRITE_ONCE( session->cursor, seq + 1 );
+		__broadcast_put( ms, seq, &dead );
+		__account_dequeue( ms, msg_len, stamp );
+		__account_numa( ms, msg );
+	}
+
+	__broadcast_put( ms, seq, &dead );	// The reference of the copy
+
+	__producer_unlock( ms );
+
+	mutex_unlock( &session->read_mutex );
+
+	if ( dead ) {
+		__message_free_chain( dead );
+		__wake_writers( ms, 1 );
+	}
+
+	if ( bytes_left > 0 ) {
+		debug_printk( KERN_WARNING "ERROR: CAN'T GET THE MESSAGE FROM MAILSLOT! SLOT N°: %d", ms->slot );
+		return -EFAULT;
+	}
+
+	return msg_len;
+
+}
+
+
+/* Broadcast mode write: the message is built once and retained with a reference per subscriber. Drop mode unsubscribes
+   the slowest subscribers when there is no room; otherwise the writer waits for them, or gets -EAGAIN. Returns
+   -EOPNOTSUPP if the mode is off, for the caller to take the regular path. */
+static ssize_t __broadcast_write( struct mailslot* ms, struct iov_iter* from, int non_blocking ) {
+
+	struct message *new_msg, *dead;
+	size_t len = iov_iter_count( from );
+	u64 head, blocked;
+	int mode, interrupted, error;
+
+	new_msg = __message_build( ms, from, 0, non_blocking );
+	if ( IS_ERR( new_msg ) ) return PTR_ERR( new_msg );
+
+	for ( ;; ) {
+
+		dead = NULL;
+
+		__producer_lock( ms );
+
+		if ( !ms->broadcast ) error = -EOPNOTSUPP;	// Turned off meanwhile
+		else if ( len > ms->max_msg_size ) error = -EPERM;
+		else {
+			if ( ms->broadcast == MAILSLOT_BROADCAST_DROP ) __broadcast_drop( ms, len, &dead );
+			error = __broadcast_room( ms, len ) ? SUCCESS : -EAGAIN;
+		}
+
+		if ( error != -EAGAIN || non_blocking ) break;
+
+		// Wait for room, or for the oldest message to go, which the drop mode may follow with more room
+		mode = ms->broadcast;
+		head = ms->bcast_head;
+
+		__producer_unlock( ms );
+
+		if ( dead ) {
+			__message_free_chain( dead );
+			__wake_readers( ms, 0 );	// The dropped subscribers
+		}
+
+		trace_mailslot_block( ms->slot, MAILSLOT_TRACE_WRITE );
+		blocked = ktime_get_ns();
+		interrupted = wait_event_interruptible_exclusive( ms->write_queue, __broadcast_room( ms, len ) ||
+			READ_ONCE( ms->broadcast ) != mode || READ_ONCE( ms->bcast_head ) != head );
+		__account_wake( ms, MAILSLOT_TRACE_WRITE, blocked );
+
+		if ( interrupted ) {
+			__message_free( new_msg );
+			return -EINTR;
+		}
+	}
+
+	if ( error ) {
+		__producer_unlock( ms );
+		__message_free( new_msg );
+		if ( dead ) {
+			__message_free_chain( dead );
+			__wake_readers( ms, 0 );
+		}
+		if ( error == -EOPNOTSUPP ) iov_iter_revert( from, len );	// Consumed by the copy into the message
+		if ( error == -EPERM ) debug_printk( KERN_WARNING "ERROR: CAN'T WRITE. MESSAGE TOO BIG! MAXIMUM NUMBER OF CHARACTERS IS %zu!", ms->max_msg_size );
+		if ( error == -EAGAIN ) debug_printk( KERN_WARNING "ERROR: CAN'T WRITE. THE MAILSLOT IS FULL! SLOT N°: %d", ms->slot );
+		return error;
+	}
+
+	// Nobody subscribed means nobody would ever read it
+	if ( ms->nr_subscribers ) {
+		new_msg->readers = ms->nr_subscribers;
+		ms->bcast[BROADCAST_SLOT( ms->bcast_tail )] = new_msg;
+		atomic_long_add( LIST_FOOTPRINT( len ), &ms->msg_bytes );
+		smp_store_release( &ms->bcast_tail, ms->bcast_tail + 1 );	// Pairs with __broadcast_readable()
+		new_msg = NULL;
+	}
+
+	__account_enqueue( ms, len );
+	trace_mailslot_enqueue( ms->slot, len, __mailslot_depth( ms ) );
+
+	debug_printk( KERN_INFO "MESSAGE BROADCAST TO %u SUBSCRIBERS! SLOT N°: %d", ms->nr_subscribers, ms->slot );
+
+	__producer_unlock( ms );
+
+	if ( new_msg ) __message_free( new_msg );
+	__message_free_chain( dead );
+
+	__wake_readers( ms, 0 );	// Every subscriber, and the dropped ones
+
+	return len;
+
+}
+
+
+/* Turn the sharded mode on or off. Called with the mailslot lock held, on an empty list engine mailslot. The lockless
+   writers reserve their room in msg_bytes before checking the mode, and the mode is cleared before msg_bytes is
+   checked: either the writer backs off, or the mailslot is seen as non-empty. */
+static int __sharded_configure( struct mailslot* ms, int on ) {
+
+	struct mailslot_shard __percpu* shards;
+	int cpu, error = SUCCESS;
+
+	if ( on && (ms->engine != MAILSLOT_ENGINE_LIST || ms->overflow || ms->broadcast) ) {
+		debug_printk( KERN_WARNING "ERROR: THE SHARDED MODE NEEDS THE LIST ENGINE, WITHOUT THE OVERWRITE POLICY AND THE BROADCAST MODE! SLOT N°: %d", ms->slot );
+		return -EINVAL;
+	}
+
+	if ( on && !ms->shards ) {
+		shards = alloc_percpu( struct mailslot_shard );
+		if ( !shards ) return -ENOMEM;
+		for_each_possible_cpu( cpu ) spin_lock_init( &per_cpu_ptr( shards, cpu )->lock );
+		ms->shards = shards;
+	}
+
+	__queue_lock_both( ms );	// Locked operations check the mode under their queue lock
+
+	if ( on != ms->sharded ) {
+		WRITE_ONCE( ms->sharded, 0 );
+		smp_mb();	// Pairs with the reservation of __sharded_write()
+		if ( atomic_long_read( &ms->msg_bytes ) ) error = -EBUSY;
+		WRITE_ONCE( ms->sharded, error ? !on : on );
+	}
+
+	__queue_unlock_both( ms );
+
+	// Sleepers of either path wait on conditions of the other mode: let them all look again
+	wake_up_interruptible_all( &ms->read_queue );
+	wake_up_interruptible_all( &ms->write_queue );
+
+	return error;
+
+}
+
+
+/* Sharded mode read: the oldest message of the shard of this CPU, or else of another one. Messages written on the
+   same CPU are read in order, but there is no order across the shards. Same interface as __spsc_read(). */
+static ssize_t __sharded_read( struct mailslot* ms, struct iov_iter* to, unsigned int mode, int non_blocking, int wait, unsigned int busy_poll ) {
+
+	struct mailslot_shard* shard;
+	struct message* msg;
+	ssize_t msg_len;
+	size_t bytes_left;
+	u64 blocked;
+	int interrupted;
+
+retry:
+	if ( !READ_ONCE( ms->sharded ) ) return -EOPNOTSUPP;
+
+	msg = __shard_take( ms, iov_iter_count( to ), mode, &shard );
+	if ( IS_ERR( msg ) ) return PTR_ERR( msg );
+
+	if ( msg ) {
+
+		// Uncounted when taken: a failed copy puts it back where it was, counted again
+		if ( non_blocking ) {
+			pagefault_disable();
+			bytes_left = __message_copy_out( msg, to, mode );
+			pagefault_enable();
+		}
+		else bytes_left = __message_copy_out( msg, to, mode );
+
+		if ( bytes_left > 0 ) {
+			debug_printk( KERN_WARNING "ERROR: CAN'T GET THE MESSAGE FROM MAILSLOT! SLOT N°: %d", ms->slot );
+			spin_lock( &shard->lock );
+			msg->next = shard->head;
+			if ( !shard->tail ) shard->tail = msg;
+			WRITE_ONCE( shard->head, msg );
+			atomic_inc( &ms->msg_count );
+			spin_unlock( &shard->lock );
+			return -EFAULT;
+		}
+
+		atomic_long_sub( LIST_FOOTPRINT( msg->length ), &ms->msg_bytes );
+		__account_dequeue( ms, msg->length, msg->stamp );
+		__account_numa( ms, msg );
+
+		__wake_writers( ms, 1 );
+
+		msg_len = msg->length;
+		__message_free( msg );
+
+		return msg_len;
+	}
+
+	if ( non_blocking || !wait ) return -EAGAIN;
+
+	if ( busy_poll && __busy_poll( ms, busy_poll ) ) goto retry;
+
+	trace_mailslot_block( ms->slot, MAILSLOT_TRACE_READ );
+	blocked = ktime_get_ns();
+	interrupted = wait_event_interruptible_exclusive( ms->read_queue, !__mailslot_empty( ms ) || !READ_ONCE( ms->sharded ) );
+	__account_wake( ms, MAILSLOT_TRACE_READ, blocked );
+	if ( interrupted ) return -EINTR;
+
+	goto retry;
+
+}
+
+
+/* Sharded mode write: the message is appended to the shard of this CPU, under the shard lock only. Priorities are
+   not kept. Same interface as __spsc_write(). */
+static ssize_t __sharded_write( struct mailslot* ms, struct iov_iter* from, int non_blocking, int wait ) {
+
+	struct mailslot_shard* shard;
+	struct message* new_msg;
+	size_t len = iov_iter_count( from );
+	u64 blocked;
+	int interrupted;
+
+	if ( !READ_ONCE( ms->sharded ) ) return -EOPNOTSUPP;
+
+	if ( len > READ_ONCE( ms->max_msg_size ) ) return -EPERM;
+
+	new_msg = __message_build( ms, from, 0, non_blocking );
+	if ( IS_ERR( new_msg ) ) return PTR_ERR( new_msg );
+
+	while ( !__shard_reserve( ms, len ) ) {
+
+		if ( non_blocking || !wait ) {
+			__message_free( new_msg );
+			return -EAGAIN;
+		}
+
+		trace_mailslot_block( ms->slot, MAILSLOT_TRACE_WRITE );
+		blocked = ktime_get_ns();
+		interrupted = wait_event_interruptible_exclusive( ms->write_queue, !__mailslot_full( ms, len ) || !READ_ONCE( ms->sharded ) );
+		__account_wake( ms, MAILSLOT_TRACE_WRITE, blocked );
+
+		if ( interrupted ) {
+			__message_free( new_msg );
+			return -EINTR;
+		}
+	}
+
+	// Reserved, then checked: see __sharded_configure()
+	if ( !READ_ONCE( ms->sharded ) ) {
+		atomic_long_sub( LIST_FOOTPRINT( len ), &ms->msg_bytes );
+		__message_free( new_msg );
+		iov_iter_revert( from, len );	// Consumed by the copy into the message
+		return -EOPNOTSUPP;
+	}
+
+	shard = raw_cpu_ptr( ms->shards );	// Being migrated meanwhile only costs some locality
+
+	new_msg->next = NULL;
+
+	spin_lock( &shard->lock );
+	if ( shard->tail ) shard->tail->next = new_msg;
+	else WRITE_ONCE( shard->head, new_msg );
+	shard->tail = new_msg;
+	atomic_inc( &ms->msg_count );	// Counted with the shard lock held, as it is uncounted: never below the linked messages
+	spin_unlock( &shard->lock );
+
+	__account_enqueue( ms, len );
+	trace_mailslot_enqueue( ms->slot, len, __mailslot_depth( ms ) );
+
+	__wake_readers( ms, 1 );
+
+	return len;
+
+}
+
+
+/* Detach the oldest message of the shard of this CPU or, if it is empty, steal one from the next non-empty shard.
+   A message longer than room is left in place and fails with -EMSGSIZE, unless truncating. Returns NULL if all the
+   shards are empty. */
+static struct message* __shard_take( struct mailslot* ms, size_t room, unsigned int mode, struct mailslot_shard** from ) {
+
+	struct mailslot_shard* shard;
+	struct message* msg;
+	size_t frame_len = (mode & MAILSLOT_READ_DRAIN) ? FRAME_HEADER : 0;
+	int cpu, local = raw_smp_processor_id();
+
+	for_each_cpu_wrap( cpu, cpu_possible_mask, local ) {
+
+		shard = per_cpu_ptr( ms->shards, cpu );
+		if ( !READ_ONCE( shard->head ) ) continue;	// Empty shards are skipped without touching their lock
+
+		spin_lock( &shard->lock );
+
+		msg = shard->head;
+
+		if ( msg && frame_len + msg->length > room && !(mode & MAILSLOT_READ_TRUNC) ) {
+			spin_unlock( &shard->lock );
+			debug_printk( KERN_WARNING "ERROR: CAN'T READ. BUFFER TOO LITTLE!" );
+			return ERR_PTR( -EMSGSIZE );
+		}
+
+		if ( msg ) {
+			WRITE_ONCE( shard->head, msg->next );
+			if ( !msg->next ) shard->tail = NULL;
+			atomic_dec( &ms->msg_count );
+		}
+
+		spin_unlock( &shard->lock );
+
+		if ( msg ) {
+			if ( cpu != local ) this_cpu_inc( ms->stats->stolen );
+			*from = shard;
+			return msg;
+		}
+	}
+
+	return NULL;
+
+}
+
+
+/* Sharded mode: reserve the room of a message of len bytes in the byte budget, the only state the writers share */
+static int __shard_reserve( struct mailslot* ms, size_t len ) {
+
+	long bytes = atomic_long_read( &ms->msg_bytes );
+
+	do {
+		if ( bytes + LIST_FOOTPRINT( len ) > READ_ONCE( ms->storage ) ) return 0;
+	} while ( !atomic_long_try_cmpxchg( &ms->msg_bytes, &bytes, bytes + LIST_FOOTPRINT( len ) ) );
+
+	return 1;
+
+}
+
+
+/* Sharded mode: length of the message the next read() of this CPU would get, or MAILSLOT_NO_MESSAGE */
+static u32 __shard_peek( struct mailslot* ms ) {
+
+	struct mailslot_shard* shard;
+	u32 next = MAILSLOT_NO_MESSAGE;
+	int cpu;
+
+	for_each_cpu_wrap( cpu, cpu_possible_mask, raw_smp_processor_id() ) {
+
+		shard = per_cpu_ptr( ms->shards, cpu );
+		if ( !READ_ONCE( shard->head ) ) continue;
+
+		spin_lock( &shard->lock );
+		if ( shard->head ) next = shard->head->length;
+		spin_unlock( &shard->lock );
+
+		if ( next != MAILSLOT_NO_MESSAGE ) break;
+	}
+
+	return next;
+
+}
+
+
+/* Control device ioctls. Slots are otherwise allocated with the default parameters on their first open(). */
+static long mailslot_ctl_ioctl( struct file* filp, unsigned int cmd, unsigned long arg ) {
+
+	if ( !capable( CAP_SYS_ADMIN ) ) return -EPERM;
+
+	switch ( cmd ) {
+
+		case MAILSLOT_CTL_CREATE:
+			return __ctl_create( (struct mailslot_create __user*) arg );
+
+		case MAILSLOT_CTL_DESTROY:
+			return __ctl_destroy( arg );
+
+		default:
+			debug_printk( KERN_WARNING "ERROR: CONTROL IOCTL COMMAND NOT IDENTIFIED! CODE: %u", cmd );
+			return -ENOTTY;
+	}
+
+}
+
+
+/* Create a slot with the given parameters (0 for the defaults), on the given minor or on the first free one, and its
+   device node. The slot is kept when idle, until __ctl_destroy(). */
+static long __ctl_create( struct mailslot_create __user* ucreate ) {
+
+	struct mailslot_create create;
+	struct mailslot* ms;
+	struct device* node;
+	unsigned long slot;
+	size_t max_msg_size, budget;
+	int error;
+
+	if ( copy_from_user( &create, ucreate, sizeof(create) ) ) return -EFAULT;
+
+	max_msg_size = create.max_msg_size ? create.max_msg_size : default_message_size;
+	budget = create.storage ? create.storage : storage;
+
+	// Same bounds as the ioctls that change them afterwards
+	if ( max_msg_size > maximum_message_size || budget > STORAGE_LIMIT ||
+		(create.engine != MAILSLOT_ENGINE_LIST && create.engine != MAILSLOT_ENGINE_RING && create.engine != MAILSLOT_ENGINE_SHARED) ||
+		(create.overflow != MAILSLOT_OVERFLOW_BLOCK && create.overflow != MAILSLOT_OVERFLOW_OVERWRITE) ||
+		(create.numa_node != MAILSLOT_NUMA_AUTO && (create.numa_node < 0 || create.numa_node >= nr_node_ids || !node_online( create.numa_node ))) ) {
+		debug_printk( KERN_WARNING "ERROR: INVALID PARAMETERS OF A NEW MAILSLOT!" );
+		return -EINVAL;
+	}
+
+	mutex_lock( &instances_lock );
+
+	if ( create.minor == MAILSLOT_ANY_MINOR ) {
+		for ( slot = 0; slot < instances && xa_load( &mailslots, slot ); slot++ );
+		error = slot < instances ? SUCCESS : -ENOSPC;
+	}
+	else {
+		slot = create.minor - first_minor;	// Wraps around below first_minor
+		error = create.minor < first_minor || slot >= instances ? -EINVAL : xa_load( &mailslots, slot ) ? -EEXIST : SUCCESS;
+	}
+
+	if ( error ) {
+		debug_printk( KERN_WARNING "ERROR: NO MINOR AVAILABLE FOR A NEW MAILSLOT!" );
+		mutex_unlock( &instances_lock );
+		return error;
+	}
+
+	ms = __mailslot_alloc( slot, create.numa_node == MAILSLOT_NUMA_AUTO ? numa_node : create.numa_node );
+
+	if ( !ms ) {
+		mutex_unlock( &instances_lock );
+		return -ENOMEM;
+	}
+
+	// Not reachable yet: the locks are only taken for the sake of __mailslot_reconfigure()
+	mutex_lock( &ms->mutex );
+	ms->overflow = create.overflow;
+	error = __mailslot_reconfigure( ms, create.engine, max_msg_size, budget );
+	mutex_unlock( &ms->mutex );
+
+	if ( !error ) error = xa_err( xa_store( &mailslots, slot, ms, GFP_KERNEL ) );
+
+	if ( error ) {
+		__mailslot_free( ms );
+		mutex_unlock( &instances_lock );
+		return error;
+	}
+
+	ms->created = 1;
+
+	node = device_create( mailslot_class, NULL, MKDEV( MAJOR( dev ), MINOR( dev ) + slot ), NULL, DEVICE_NAME "%lu", first_minor + slot );
+
+	if ( IS_ERR( node ) ) {
+		xa_erase( &mailslots, slot );
+		__mailslot_free( ms );
+		mutex_unlock( &instances_lock );
+		return PTR_ERR( node );
+	}
+
+	mutex_unlock( &instances_lock );
+
+	create.minor = first_minor + slot;
+	create.major = MAJOR( dev );
+	snprintf( create.name, sizeof(create.name), DEVICE_NAME "%lu", first_minor + slot );
+
+	debug_printk( KERN_INFO "MAILSLOT CREATED! SLOT N°: %lu", slot );
+
+	// The slot stays created: destroying it is up to the caller
+	return copy_to_user( ucreate, &create, sizeof(create) ) ? -EFAULT : SUCCESS;
+
+}
+
+
+/* Destroy a slot created through the control device, with its queued messages. It must not be open. */
+static long __ctl_destroy( unsigned long minor ) {
+
+	struct mailslot_counters counters;
+	struct mailslot* ms;
+	unsigned long slot = minor - first_minor;
+	int error = SUCCESS;
+
+	mutex_lock( &instances_lock );
+
+	ms = minor >= first_minor && slot < instances ? xa_load( &mailslots, slot ) : NULL;
+
+	if ( !ms || !ms->created ) error = -ENOENT;
+	else if ( ms->users ) error = -EBUSY;
+	else {
+		device_destroy( mailslot_class, MKDEV( MAJOR( dev ), MINOR( dev ) + slot ) );
+		xa_erase( &mailslots, slot );
+		__counters_read( ms, &counters );	// Still part of the totals
+		__counters_add( &retired_stats, &counters );
+		__mailslot_free( ms );
+		debug_printk( KERN_INFO "MAILSLOT DESTROYED! SLOT N°: %lu", slot );
+	}
+
+	mutex_unlock( &instances_lock );
+
+	return error;
+
+}
@@ -0,0 +1,138 @@
+/**********************************************************************************************
+* Tracepoints of the mailslot driver. They cost a patched-out branch when disabled; enable    *
+* them through tracefs, e.g. echo 1 > /sys/kernel/tracing/events/mailslot/enable              *
+**********************************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mailslot
+
+#if !defined( _MAILSLOT_TRACE_H ) || defined( TRACE_HEADER_MULTI_READ )
+#define _MAILSLOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Direction of a blocked operation and operation that failed */
+#define MAILSLOT_TRACE_READ 0
+#define MAILSLOT_TRACE_WRITE 1
+
+#define show_mailslot_op( op ) __print_symbolic( op,	\
+	{ MAILSLOT_TRACE_READ, "read" },		\
+	{ MAILSLOT_TRACE_WRITE, "write" } )
+
+TRACE_EVENT( mailslot_enqueue,
+
+	TP_PROTO( int slot, size_t len, int count ),
+
+	TP_ARGS( slot, len, count ),
+
+	TP_STRUCT__entry(
+		__field( int, slot )
+		__field( size_t, len )
+		__field( int, count )
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->len = len;
+		__entry->count = count;
+	),
+
+	TP_printk( "slot=%d len=%zu count=%d", __entry->slot, __entry->len, __entry->count )
+);
+
+TRACE_EVENT( mailslot_dequeue,
+
+	TP_PROTO( int slot, size_t len, int count, u64 latency_ns ),
+
+	TP_ARGS( slot, len, count, latency_ns ),
+
+	TP_STRUCT__entry(
+		__field( int, slot )
+		__field( size_t, len )
+		__field( int, count )
+		__field( u64, latency_ns )
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->len = len;
+		__entry->count = count;
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk( "slot=%d len=%zu count=%d latency_ns=%llu", __entry->slot, __entry->len, __entry->count,
+		(unsigned long long) __entry->latency_ns )
+);
+
+TRACE_EVENT( mailslot_block,
+
+	TP_PROTO( int slot, int op ),
+
+	TP_ARGS( slot, op ),
+
+	TP_STRUCT__entry(
+		__field( int, slot )
+		__field( int, op )
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->op = op;
+	),
+
+	TP_printk( "slot=%d op=%s", __entry->slot, show_mailslot_op( __entry->op ) )
+);
+
+TRACE_EVENT( mailslot_wake,
+
+	TP_PROTO( int slot, int op, u64 blocked_ns ),
+
+	TP_ARGS( slot, op, blocked_ns ),
+
+	TP_STRUCT__entry(
+		__field( int, slot )
+		__field( int, op )
+		__field( u64, blocked_ns )
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->op = op;
+		__entry->blocked_ns = blocked_ns;
+	),
+
+	TP_printk( "slot=%d op=%s blocked_ns=%llu", __entry->slot, show_mailslot_op( __entry->op ),
+		(unsigned long long) __entry->blocked_ns )
+);
+
+TRACE_EVENT( mailslot_error,
+
+	TP_PROTO( int slot, int op, size_t len, int error ),
+
+	TP_ARGS( slot, op, len, error ),
+
+	TP_STRUCT__entry(
+		__field( int, slot )
+		__field( int, op )
+		__field( size_t, len )
+		__field( int, error )
+	),
+
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->op = op;
+		__entry->len = len;
+		__entry->error = error;
+	),
+
+	TP_printk( "slot=%d op=%s len=%zu error=%d", __entry->slot, show_mailslot_op( __entry->op ),
+		__entry->len, __entry->error )
+);
+
+#endif /* _MAILSLOT_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE mailslot_trace
+#include <trace/define_trace.h>
@@ -1,27 +1,110 @@
+#define _GNU_SOURCE	// splice()
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include "ioctl_cmd.h" // IOCTL commands
 
 #define DEVICE "/dev/test_dev"
+#define CONTROL_DEVICE "/dev/mailslot-ctl"
 #define MAILSLOT_STORAGE 8
-#define MAXIMUM_MESSAGE_SIZE 512
+#define MAXIMUM_MESSAGE_SIZE 4194304
+#define LARGE_MESSAGE_SIZE 1048576
 #define VERSION "1.0"
 
 
+/* Does nothing: only there for the alarm to interrupt a blocking call */
+static void on_alarm(int sig) {
+
+	(void) sig;
+
+}
+
+
+/* Reads through a single entry io_uring (raw syscalls, no liburing): returns the completion result */
+static int uring_read(int fd, void* buffer, unsigned int length) {
+
+	struct io_uring_params params;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqe;
+	char *sq, *cq;
+	unsigned int *sq_tail, *cq_head;
+	size_t sq_size, cq_size, sqes_size;
+	int ring, result = -1;
+
+	memset(&params, 0, sizeof(params));
+	ring = syscall(__NR_io_uring_setup, 1, &params);
+	if(ring < 0) return -1;
+
+	sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+	sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+	if(sq != MAP_FAILED && cq != MAP_FAILED && sqes != MAP_FAILED) {
+		memset(&sqes[0], 0, sizeof(sqes[0]));
+		sqes[0].opcode = IORING_OP_READ;
+		sqes[0].fd = fd;
+		sqes[0].addr = (__u64) (unsigned long) buffer;
+		sqes[0].len = length;
+		((unsigned int*) (sq + params.sq_off.array))[0] = 0;
+		sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+		__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+
+		if(syscall(__NR_io_uring_enter, ring, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) == 1) {
+			cq_head = (unsigned int*) (cq + params.cq_off.head);
+			cqe = (struct io_uring_cqe*) (cq + params.cq_off.cqes) + (*cq_head & *(unsigned int*) (cq + params.cq_off.ring_mask));
+			result = cqe->res;
+		}
+	}
+
+	if(sq != MAP_FAILED) munmap(sq, sq_size);
+	if(cq != MAP_FAILED) munmap(cq, cq_size);
+	if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+	close(ring);
+	return result;
+
+}
+
+
 int main() {
 
-	int i, result, pid;
+	int i, result, pid, pipe_fds[2], subscriber;
+	struct pollfd pfd;
+	struct mailslot_msg msgs[3];
+	struct mailslot_batch batch;
+	struct mailslot_info info;
+	struct mailslot_recv_any any;
+	__s32 any_fds[2];
+	struct mailslot_create create;
+	int control;
+	struct mailslot_shared_header* shared;
+	struct mailslot_shared_cell* cell;
+	__u64 map_size, budget;
+	__u32 frame;
+	struct iovec iov[2];
+	struct sigaction action;
+	char drain[64];
+	char* untouched;
 	char string4[] = "the";
 	char string5[] = "this";
 	char string6[] = "hello";
 	char* buffer4 = malloc(4*sizeof(char)); memset(buffer4, 0, 4*sizeof(char));
 	char* buffer5 = malloc(5*sizeof(char)); memset(buffer5, 0, 5*sizeof(char));
 	char* buffer6 = malloc(6*sizeof(char)); memset(buffer6, 0, 6*sizeof(char));
+	char* large_out = malloc(LARGE_MESSAGE_SIZE); memset(large_out, 'x', LARGE_MESSAGE_SIZE);
+	char* large_in = malloc(LARGE_MESSAGE_SIZE); memset(large_in, 0, LARGE_MESSAGE_SIZE);
 
 	system("reset");
 	setbuf(stdout, NULL);
@@ -45,12 +128,13 @@ int main() {
 	result < 0 && MAXIMUM_MESSAGE_SIZE >= 64 ? printf("Something went wrong 3\n\n") : printf("[ok]\n\n");
 
 	printf("Setting the new maximum message size to %d... [it should be ok]\n", MAXIMUM_MESSAGE_SIZE);
+	ioctl(file_descriptor, SET_MAILSLOT_STORAGE, 2 * MAXIMUM_MESSAGE_SIZE);	// Room for a message of the maximum size
 	result = ioctl(file_descriptor, SET_MAXIMUM_MSG_SIZE, MAXIMUM_MESSAGE_SIZE);	
 	result < 0 ? printf("Something went wrong 4\n\n") : printf("[ok]\n\n");
 
-	printf("Setting the new maximum message size to 2000... [it should fail]\n");
-	result = ioctl(file_descriptor, SET_MAXIMUM_MSG_SIZE, 2000);
-	result < 0 ? printf("[failed] You can't set the maximum message size to 2000!\n\n") : printf("Something went wrong 5\n\n");
+	printf("Setting the new maximum message size to %d... [it should fail]\n", MAXIMUM_MESSAGE_SIZE + 1);
+	result = ioctl(file_descriptor, SET_MAXIMUM_MSG_SIZE, MAXIMUM_MESSAGE_SIZE + 1);
+	result < 0 ? printf("[failed] You can't set the maximum message size to %d!\n\n", MAXIMUM_MESSAGE_SIZE + 1) : printf("Something went wrong 5\n\n");
 
 
 	/* SETTING NON-BLOCKING AND BLOCKING POLICY */	
@@ -191,6 +275,342 @@ int main() {
 		read(file_descriptor, buffer5, sizeof(buffer5)) != -1 ? printf("\tread #%d [ok]\n", i+1) : printf("\tread #%d [failed]\n", i+1); // read string5;
 		
 
+	/* SEND AND RECEIVE A BATCH OF MESSAGES WITH A SINGLE IOCTL */
+
+	printf("\nSend 3 messages with one ioctl and receive them with another... [it should be ok]\n");
+	msgs[0].buffer = (unsigned long) string4; msgs[0].length = sizeof(string4); msgs[0].flags = 0;
+	msgs[1].buffer = (unsigned long) string5; msgs[1].length = sizeof(string5); msgs[1].flags = 0;
+	msgs[2].buffer = (unsigned long) string6; msgs[2].length = sizeof(string6); msgs[2].flags = 0;
+	batch.msgs = (unsigned long) msgs; batch.count = 3;
+	result = ioctl(file_descriptor, MAILSLOT_SEND_BATCH, &batch);
+	result == 3 && batch.done == 3 ? printf("\t[ok]\n") : printf("\tSomething went wrong 42\n");
+
+	msgs[0].buffer = (unsigned long) buffer4; msgs[0].length = 4;
+	msgs[1].buffer = (unsigned long) buffer5; msgs[1].length = 5;
+	msgs[2].buffer = (unsigned long) buffer6; msgs[2].length = 6;
+	result = ioctl(file_descriptor, MAILSLOT_RECV_BATCH, &batch);
+	result == 3 && msgs[2].result == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 43\n");
+
+
+	/* POLL THE MAILSLOT FOR READABILITY AND WRITABILITY */
+
+	printf("\nPoll an empty mailslot... [it should be writable but not readable]\n");
+	pfd.fd = file_descriptor; pfd.events = POLLIN | POLLOUT;
+	result = poll(&pfd, 1, 0);
+	result == 1 && pfd.revents == POLLOUT ? printf("\t[ok]\n") : printf("\tSomething went wrong 38\n");
+
+	printf("Poll a mailslot holding a message... [it should be readable and writable]\n");
+	result = write(file_descriptor, &string5, sizeof(string5)); if (result == -1) printf("\tSomething went wrong 39\n"); // write string5
+	result = poll(&pfd, 1, 0);
+	result == 1 && pfd.revents == (POLLIN | POLLOUT) ? printf("\t[ok]\n") : printf("\tSomething went wrong 40\n");
+	result = read(file_descriptor, buffer5, sizeof(buffer5)); if (result == -1) printf("\tSomething went wrong 41\n"); // clean
+
+
+	/* EXCHANGE A MESSAGE THROUGH THE MAPPED SHARED RING */
+
+	printf("\nSwitch to the shared engine and map its ring... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_STORAGE_ENGINE, MAILSLOT_ENGINE_SHARED); if (result < 0) printf("\tSomething went wrong 44\n");
+	result = ioctl(file_descriptor, MAILSLOT_GET_MAP_SIZE, &map_size);
+	shared = result < 0 ? MAP_FAILED : mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor, 0);
+	shared != MAP_FAILED && shared->magic == MAILSLOT_SHARED_MAGIC ? printf("\t[ok]\n") : printf("\tSomething went wrong 45\n");
+
+	if (shared != MAP_FAILED) {
+		printf("Write a message and consume it from the mapping... [it should be ok]\n");
+		result = write(file_descriptor, &string6, sizeof(string6)); if (result == -1) printf("\tSomething went wrong 46\n"); // write string6
+		cell = (struct mailslot_shared_cell*) ((char*) shared + shared->data_offset);
+		if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) == 1 && cell->length == sizeof(string6) && strncmp(string6, (char*) (cell + 1), sizeof(string6)) == 0
+				&& __sync_bool_compare_and_swap(&shared->consumer, 0, 1)) {
+			__atomic_store_n(&cell->sequence, shared->cell_count, __ATOMIC_RELEASE);
+			printf("\t[ok]\n");
+		}
+		else printf("\tSomething went wrong 47\n");
+
+		printf("Corrupt the sequence of the next cell, then read and get interrupted... [it should fail]\n");
+		cell = (struct mailslot_shared_cell*) ((char*) shared + shared->data_offset + (shared->consumer & (shared->cell_count - 1)) * shared->cell_size);
+		__atomic_store_n(&cell->sequence, shared->consumer + 5, __ATOMIC_RELEASE);	// Neither empty nor ready
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = on_alarm;	// No SA_RESTART: the read has to return
+		sigaction(SIGALRM, &action, NULL);
+		alarm(1);
+		result = read(file_descriptor, buffer6, 6);
+		alarm(0);
+		result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 115\n");
+		__atomic_store_n(&cell->sequence, shared->consumer, __ATOMIC_RELEASE);	// Empty again
+		signal(SIGALRM, SIG_DFL);
+
+		printf("Switch back to the list engine while mapped... [it should fail]\n");
+		result = ioctl(file_descriptor, SET_STORAGE_ENGINE, MAILSLOT_ENGINE_LIST);
+		result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 48\n");
+		munmap(shared, map_size);
+	}
+
+	result = ioctl(file_descriptor, SET_STORAGE_ENGINE, MAILSLOT_ENGINE_LIST); if (result < 0) printf("\tSomething went wrong 49\n");
+
+
+	/* LOCKLESS SINGLE-PRODUCER/SINGLE-CONSUMER MODE OF THE RING ENGINE */
+
+	printf("\nEnable the SPSC mode on the list engine... [it should fail]\n");
+	result = ioctl(file_descriptor, SET_SPSC_MODE, 1);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 50\n");
+
+	printf("Enable it on the ring engine, then write and read a message... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_STORAGE_ENGINE, MAILSLOT_ENGINE_RING); if (result < 0) printf("\tSomething went wrong 51\n");
+	result = ioctl(file_descriptor, SET_SPSC_MODE, 1); if (result < 0) printf("\tSomething went wrong 52\n");
+	result = write(file_descriptor, &string6, sizeof(string6)); if (result == -1) printf("\tSomething went wrong 53\n"); // write string6
+	result = read(file_descriptor, buffer6, 6);
+	result == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 54\n");
+	result = ioctl(file_descriptor, SET_SPSC_MODE, 0); if (result < 0) printf("\tSomething went wrong 55\n");
+	result = ioctl(file_descriptor, SET_STORAGE_ENGINE, MAILSLOT_ENGINE_LIST); if (result < 0) printf("\tSomething went wrong 56\n");
+
+
+	/* BYTE BUDGET OF THE MAILSLOT */
+
+	printf("\nSet a storage budget that can't hold a message of the maximum size... [it should fail]\n");
+	result = ioctl(file_descriptor, SET_MAILSLOT_STORAGE, 16);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 57\n");
+
+	printf("Set a storage budget of 64 KiB and read it back... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_MAILSLOT_STORAGE, 65536); if (result < 0) printf("\tSomething went wrong 58\n");
+	result = ioctl(file_descriptor, GET_MAILSLOT_STORAGE, &budget);
+	result == 0 && budget == 65536 ? printf("\t[ok]\n") : printf("\tSomething went wrong 59\n");
+
+
+	/* LARGE MESSAGES AND SPLICE */
+
+	printf("\nWrite and read a message of %d bytes... [it should be ok]\n", LARGE_MESSAGE_SIZE);
+	result = ioctl(file_descriptor, SET_MAILSLOT_STORAGE, 2 * LARGE_MESSAGE_SIZE); if (result < 0) printf("\tSomething went wrong 60\n");
+	result = ioctl(file_descriptor, SET_MAXIMUM_MSG_SIZE, LARGE_MESSAGE_SIZE); if (result < 0) printf("\tSomething went wrong 61\n");
+	result = write(file_descriptor, large_out, LARGE_MESSAGE_SIZE); if (result != LARGE_MESSAGE_SIZE) printf("\tSomething went wrong 62\n");
+	result = read(file_descriptor, large_in, LARGE_MESSAGE_SIZE);
+	result == LARGE_MESSAGE_SIZE && memcmp(large_out, large_in, LARGE_MESSAGE_SIZE) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 63\n");
+
+	printf("Switch to the ring engine with this maximum message size... [it should fail]\n");
+	result = ioctl(file_descriptor, SET_STORAGE_ENGINE, MAILSLOT_ENGINE_RING);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 114\n");
+
+	printf("Splice a message from a pipe into the mailslot and back... [it should be ok]\n");
+	if (pipe(pipe_fds) == 0) {
+		write(pipe_fds[1], &string6, sizeof(string6));
+		result = splice(pipe_fds[0], NULL, file_descriptor, NULL, LARGE_MESSAGE_SIZE, 0); if (result != sizeof(string6)) printf("\tSomething went wrong 64\n");
+		result = splice(file_descriptor, NULL, pipe_fds[1], NULL, LARGE_MESSAGE_SIZE, 0); if (result != sizeof(string6)) printf("\tSomething went wrong 65\n");
+		result = read(pipe_fds[0], buffer6, 6);
+		result == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 66\n");
+		close(pipe_fds[0]); close(pipe_fds[1]);
+	}
+	else printf("\tSomething went wrong 67\n");
+
+
+	/* SCATTER-GATHER WRITE AND DRAIN READ MODE */
+
+	printf("\nWrite a message from two iovecs and read it back as one... [it should be ok]\n");
+	iov[0].iov_base = string4; iov[0].iov_len = sizeof(string4) - 1;	// "the" without the terminator
+	iov[1].iov_base = string5; iov[1].iov_len = sizeof(string5);
+	result = writev(file_descriptor, iov, 2); if (result != 8) printf("\tSomething went wrong 68\n");
+	result = read(file_descriptor, drain, sizeof(drain));
+	result == 8 && strcmp(drain, "thethis") == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 69\n");
+
+	printf("Read two messages with a single read in drain mode... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_READ_MODE, MAILSLOT_READ_DRAIN); if (result < 0) printf("\tSomething went wrong 70\n");
+	write(file_descriptor, &string4, sizeof(string4));
+	write(file_descriptor, &string6, sizeof(string6));
+	result = read(file_descriptor, drain, sizeof(drain));
+	if (result == 2 * sizeof(frame) + sizeof(string4) + sizeof(string6)) {
+		memcpy(&frame, drain, sizeof(frame));
+		i = frame == sizeof(string4) && strcmp(drain + sizeof(frame), string4) == 0;
+		memcpy(&frame, drain + sizeof(frame) + sizeof(string4), sizeof(frame));
+		i = i && frame == sizeof(string6) && strcmp(drain + 2 * sizeof(frame) + sizeof(string4), string6) == 0;
+		i ? printf("\t[ok]\n") : printf("\tSomething went wrong 71\n");
+	}
+	else printf("\tSomething went wrong 72\n");
+	result = ioctl(file_descriptor, SET_READ_MODE, 0); if (result < 0) printf("\tSomething went wrong 73\n");
+
+
+	/* MAILSLOT INFO AND TRUNCATING READ MODE */
+
+	printf("\nGet the length of the next message without reading it... [it should be ok]\n");
+	write(file_descriptor, &string6, sizeof(string6));
+	result = ioctl(file_descriptor, MAILSLOT_GET_INFO, &info);
+	result == 0 && info.next_size == sizeof(string6) && info.msg_count == 1 ? printf("\t[ok]\n") : printf("\tSomething went wrong 74\n");
+
+	printf("Read it truncated into a 4 byte buffer... [it should return its whole length]\n");
+	result = ioctl(file_descriptor, SET_READ_MODE, MAILSLOT_READ_TRUNC); if (result < 0) printf("\tSomething went wrong 75\n");
+	result = read(file_descriptor, buffer4, 4);
+	result == sizeof(string6) && strncmp(buffer4, string6, 4) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 76\n");
+	result = ioctl(file_descriptor, MAILSLOT_GET_INFO, &info);
+	result == 0 && info.next_size == MAILSLOT_NO_MESSAGE && info.msg_count == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 77\n");
+	result = ioctl(file_descriptor, SET_READ_MODE, MAILSLOT_READ_DRAIN | MAILSLOT_READ_TRUNC);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 78\n");
+	ioctl(file_descriptor, SET_READ_MODE, 0);
+
+
+	/* BUSY POLLING */
+
+	printf("\nSet a busy polling budget above the limit... [it should fail]\n");
+	result = ioctl(file_descriptor, SET_BUSY_POLL, 20000);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 79\n");
+
+	printf("Read with a busy polling budget of 50 us... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_BUSY_POLL, 50); if (result < 0) printf("\tSomething went wrong 80\n");
+	write(file_descriptor, &string6, sizeof(string6));
+	result = read(file_descriptor, buffer6, 6);
+	result == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 81\n");
+	ioctl(file_descriptor, SET_BUSY_POLL, 0);
+
+
+	/* PRIORITY LANES */
+
+	printf("\nWrite a message at priority 0, then one at priority 5... [the second one should be read first]\n");
+	write(file_descriptor, &string4, sizeof(string4));
+	result = ioctl(file_descriptor, SET_WRITE_PRIORITY, 5); if (result < 0) printf("\tSomething went wrong 82\n");
+	write(file_descriptor, &string5, sizeof(string5));
+	result = read(file_descriptor, buffer5, 5);
+	result == 5 && strncmp(string5, buffer5, sizeof(string5)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 83\n");
+	result = read(file_descriptor, buffer4, 4);
+	result == 4 && strncmp(string4, buffer4, sizeof(string4)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 84\n");
+
+	printf("Set a priority out of range... [it should fail]\n");
+	result = ioctl(file_descriptor, SET_WRITE_PRIORITY, MAILSLOT_PRIORITIES);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 85\n");
+	ioctl(file_descriptor, SET_WRITE_PRIORITY, 0);
+
+
+	/* BROADCAST MODE */
+
+	printf("\nSubscribe two files to a broadcast mailslot and write a message once... [both should read it]\n");
+	result = ioctl(file_descriptor, SET_BROADCAST_MODE, MAILSLOT_BROADCAST_BLOCK); if (result < 0) printf("\tSomething went wrong 86\n");
+	subscriber = open(DEVICE, O_RDWR | O_NONBLOCK);
+	result = ioctl(file_descriptor, MAILSLOT_SUBSCRIBE, 1) | ioctl(subscriber, MAILSLOT_SUBSCRIBE, 1); if (result < 0) printf("\tSomething went wrong 87\n");
+	write(file_descriptor, &string6, sizeof(string6));
+	result = read(file_descriptor, buffer6, 6);
+	result == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 88\n");
+	memset(buffer6, 0, 6);
+	result = read(subscriber, buffer6, 6);
+	result == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 89\n");
+	result = read(subscriber, buffer6, 6);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 90\n");
+
+	printf("Read from a file after unsubscribing it... [it should fail]\n");
+	ioctl(subscriber, MAILSLOT_SUBSCRIBE, 0);
+	write(file_descriptor, &string4, sizeof(string4));
+	result = read(subscriber, buffer4, 4);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 91\n");
+	read(file_descriptor, buffer4, 4);
+	close(subscriber);
+
+	printf("Turn the broadcast mode off... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_BROADCAST_MODE, MAILSLOT_BROADCAST_OFF);
+	result == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 92\n");
+
+
+	/* OVERWRITE OVERFLOW POLICY */
+
+	printf("\nWrite 1000 messages with the overwrite policy... [every write should succeed]\n");
+	result = ioctl(file_descriptor, SET_OVERFLOW_POLICY, MAILSLOT_OVERFLOW_OVERWRITE); if (result < 0) printf("\tSomething went wrong 93\n");
+	for (i = 0; i < 1000 && write(file_descriptor, &string6, sizeof(string6)) == sizeof(string6); i++);
+	i == 1000 ? printf("\t[ok]\n") : printf("\tSomething went wrong 94\n");
+
+	printf("Only the newest messages are left... [it should be ok]\n");
+	result = ioctl(file_descriptor, MAILSLOT_GET_INFO, &info);
+	result == 0 && info.msg_count > 0 && info.msg_count < 1000 ? printf("\t[ok]\n") : printf("\tSomething went wrong 95\n");
+	for (i = 0; i < (int) info.msg_count; i++) read(file_descriptor, buffer6, 6);
+	result = ioctl(file_descriptor, SET_OVERFLOW_POLICY, MAILSLOT_OVERFLOW_BLOCK); if (result < 0) printf("\tSomething went wrong 96\n");
+
+
+	/* SHARDED MODE */
+
+	printf("\nWrite and read 3 messages in sharded mode... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_SHARDED_MODE, 1); if (result < 0) printf("\tSomething went wrong 97\n");
+	for (i = 0; i < 3; i++) write(file_descriptor, &string6, sizeof(string6));
+	result = ioctl(file_descriptor, MAILSLOT_GET_INFO, &info);
+	result == 0 && info.msg_count == 3 && info.next_size == sizeof(string6) ? printf("\t[ok]\n") : printf("\tSomething went wrong 98\n");
+	for (i = 0; i < 3 && read(file_descriptor, buffer6, 6) == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0; i++);
+	i == 3 ? printf("\t[ok]\n") : printf("\tSomething went wrong 99\n");
+
+	printf("Turn the sharded mode off... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_SHARDED_MODE, 0);
+	result == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 100\n");
+
+
+	/* NUMA PLACEMENT */
+
+	printf("\nAllocate the payloads on node 0, then write and read a message... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_NUMA_NODE, 0); if (result < 0) printf("\tSomething went wrong 101\n");
+	write(file_descriptor, &string6, sizeof(string6));
+	result = read(file_descriptor, buffer6, 6);
+	result == 6 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 102\n");
+
+	printf("Set a node that does not exist... [it should be an error]\n");
+	result = ioctl(file_descriptor, SET_NUMA_NODE, 1 << 20);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 103\n");
+
+	printf("Let the payloads follow the readers again... [it should be ok]\n");
+	result = ioctl(file_descriptor, SET_NUMA_NODE, MAILSLOT_NUMA_AUTO);
+	result == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 104\n");
+
+
+	/* RECEIVE FROM ANY OF SEVERAL MAILSLOTS */
+
+	printf("\nWrite a message and receive it from any of 2 mailslots... [it should be ok]\n");
+	write(file_descriptor, &string6, sizeof(string6));
+	any_fds[0] = file_descriptor; any_fds[1] = file_descriptor;
+	memset(&any, 0, sizeof(any));
+	any.fds = (__u64) (unsigned long) any_fds; any.count = 2;
+	any.buffer = (__u64) (unsigned long) buffer6; any.length = 6;
+	result = ioctl(file_descriptor, MAILSLOT_RECV_ANY, &any);
+	result == 6 && any.index == 0 && strncmp(string6, buffer6, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 105\n");
+
+	printf("Receive from any of 2 empty mailslots in non-blocking mode... [it should fail]\n");
+	ioctl(file_descriptor, SET_NONBLOCKING);
+	result = ioctl(file_descriptor, MAILSLOT_RECV_ANY, &any);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 106\n");
+	ioctl(file_descriptor, SET_BLOCKING);
+
+	printf("Receive from a file that is not a mailslot... [it should fail]\n");
+	any_fds[1] = 0;
+	result = ioctl(file_descriptor, MAILSLOT_RECV_ANY, &any);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 107\n");
+
+	printf("Receive from a mailslot opened write-only... [it should fail]\n");
+	write(file_descriptor, &string6, sizeof(string6));
+	any_fds[1] = open(DEVICE, O_WRONLY);
+	any.count = 2;
+	result = ioctl(file_descriptor, MAILSLOT_RECV_ANY, &any);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 111\n");
+	close(any_fds[1]);
+	result = read(file_descriptor, buffer6, 6);	// Still queued
+	result == 6 ? printf("\t[ok]\n") : printf("\tSomething went wrong 112\n");
+
+
+	/* IO_URING */
+
+	printf("\nRead through io_uring into a buffer never touched yet... [it should be ok]\n");
+	write(file_descriptor, &string6, sizeof(string6));
+	untouched = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);	// Not resident until the first fault
+	result = uring_read(file_descriptor, untouched, 6);
+	result == 6 && strncmp(string6, untouched, sizeof(string6)) == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 113 (%d)\n", result);
+	munmap(untouched, 4096);
+
+
+	/* CONTROL DEVICE */
+
+	printf("\nCreate a ring engine mailslot on the first free minor... [it should be ok]\n");
+	control = open(CONTROL_DEVICE, O_RDWR);
+	memset(&create, 0, sizeof(create));
+	create.minor = MAILSLOT_ANY_MINOR; create.max_msg_size = 256; create.storage = 65536;
+	create.engine = MAILSLOT_ENGINE_RING; create.numa_node = MAILSLOT_NUMA_AUTO;
+	result = ioctl(control, MAILSLOT_CTL_CREATE, &create);
+	result == 0 && create.minor != MAILSLOT_ANY_MINOR && strncmp(create.name, "mailslot", 8) == 0 ? printf("\t[ok] /dev/%s\n", create.name) : printf("\tSomething went wrong 108\n");
+
+	printf("Create it again... [it should fail]\n");
+	result = ioctl(control, MAILSLOT_CTL_CREATE, &create);
+	result < 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 109\n");
+
+	printf("Destroy it... [it should be ok]\n");
+	result = ioctl(control, MAILSLOT_CTL_DESTROY, create.minor);
+	result == 0 ? printf("\t[ok]\n") : printf("\tSomething went wrong 110\n");
+	close(control);
+
+
 	/* TEST READ/WRITE ALTERNATE IN BLOCKING MODE WITH THE HELP OF THE FORK SYSCALL */
 	
 	result = ioctl(file_descriptor, SET_BLOCKING);	if(result < 0)	printf("Something went wrong 34\n"); 
@@ -213,7 +633,7 @@ int main() {
 	else printf("\tSomething went wrong 37\n");
 
 
-	free(buffer4); free(buffer5); free(buffer6);
+	free(buffer4); free(buffer5); free(buffer6); free(large_out); free(large_in);
 	close(file_descriptor);
 	return 0;
 